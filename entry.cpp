@@ -4,6 +4,33 @@
 #include <valarray>
 #include <memory>
 #include <sstream>
+#include <chrono>
+#include <random>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <type_traits>
+#include <coroutine>
+#include <termios.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <cerrno>
+#include <cstdio>
 
 using std::cerr;
 using std::cout;
@@ -15,14 +42,118 @@ using std::slice;
 using std::stringstream;
 using std::ostream;
 using std::string;
+using namespace std::chrono_literals;
 
 std::ostream &endl(std::ostream &os) { return os << std::endl; }
 
 template <typename T>
 using uptr = std::unique_ptr<T>;
 
-constexpr uint32_t Pixel = L'\u2584';
-constexpr uint32_t EmptyCell = ' ';
+/******************************************************************************/
+/* Tables                                                                     */
+
+// Palette and glyph tables, all built at compile time so color and glyph
+// decisions on the hot path are lookups with no startup cost.
+
+struct Rgb
+{
+    uint8_t r, g, b;
+};
+
+// channel values of the xterm 6x6x6 color cube
+constexpr std::array<uint8_t, 6> CubeLevels = { 0, 95, 135, 175, 215, 255 };
+constexpr int GrayLevels = 24;
+
+// the 24 step gray ramp at the end of the palette
+constexpr uint8_t grayValue(int i) noexcept
+{
+    return uint8_t(8 + 10 * i);
+}
+
+constexpr std::array<Rgb, 256> makePalette() noexcept
+{
+    constexpr Rgb ansi[16] = {
+        {   0,   0,   0 }, { 205,   0,   0 }, {   0, 205,   0 }, { 205, 205,   0 },
+        {   0,   0, 238 }, { 205,   0, 205 }, {   0, 205, 205 }, { 229, 229, 229 },
+        { 127, 127, 127 }, { 255,   0,   0 }, {   0, 255,   0 }, { 255, 255,   0 },
+        {  92,  92, 255 }, { 255,   0, 255 }, {   0, 255, 255 }, { 255, 255, 255 },
+    };
+    std::array<Rgb, 256> palette{};
+    for (int i = 0; i < 16; i++) {
+        palette[i] = ansi[i];
+    }
+    for (int i = 0; i < 216; i++) {
+        palette[16 + i] = Rgb{ CubeLevels[i / 36], CubeLevels[i / 6 % 6], CubeLevels[i % 6] };
+    }
+    for (int i = 0; i < GrayLevels; i++) {
+        auto v = grayValue(i);
+        palette[232 + i] = Rgb{ v, v, v };
+    }
+    return palette;
+}
+
+// xterm-256 palette index to RGB
+constexpr auto Palette = makePalette();
+
+// channel value to the index of the nearest cube level
+constexpr std::array<uint8_t, 256> makeCubeIndex() noexcept
+{
+    std::array<uint8_t, 256> index{};
+    for (int v = 0, level = 0; v < 256; v++) {
+        while (level < 5 and v - CubeLevels[level] > CubeLevels[level + 1] - v) {
+            level++;
+        }
+        index[v] = uint8_t(level);
+    }
+    return index;
+}
+
+constexpr auto CubeIndex = makeCubeIndex();
+
+// gray value to the nearest step of the gray ramp
+constexpr std::array<uint8_t, 256> makeGrayIndex() noexcept
+{
+    std::array<uint8_t, 256> index{};
+    for (int v = 0; v < 256; v++) {
+        int i = (v - 3) / 10;
+        index[v] = uint8_t(i < 0 ? 0 : i >= GrayLevels ? GrayLevels - 1 : i);
+    }
+    return index;
+}
+
+constexpr auto GrayIndex = makeGrayIndex();
+
+// Glyphs by coverage mask. Half blocks: bit 0 top, bit 1 bottom.
+constexpr std::array<uint32_t, 4> HalfBlocks = { ' ', U'\u2580', U'\u2584', U'\u2588' };
+
+// Quadrants: bit 0 top left, 1 top right, 2 bottom left, 3 bottom right.
+constexpr std::array<uint32_t, 16> Quadrants = {
+    ' ',       U'\u2598', U'\u259d', U'\u2580', U'\u2596', U'\u258c', U'\u259e', U'\u259b',
+    U'\u2597', U'\u259a', U'\u2590', U'\u259c', U'\u2584', U'\u2599', U'\u259f', U'\u2588',
+};
+
+// Braille: bit row * 2 + column of the 2x4 dot cell. Unicode numbers the dots
+// down the left column, then the right one, with the bottom row added last.
+constexpr std::array<uint32_t, 256> makeBraille() noexcept
+{
+    constexpr int dotBit[8] = { 0, 3, 1, 4, 2, 5, 6, 7 };
+    std::array<uint32_t, 256> glyphs{};
+    for (int mask = 0; mask < 256; mask++) {
+        uint32_t bits = 0;
+        for (int dot = 0; dot < 8; dot++) {
+            if (mask & (1 << dot)) {
+                bits |= 1u << dotBit[dot];
+            }
+        }
+        glyphs[mask] = 0x2800 + bits;
+    }
+    return glyphs;
+}
+
+constexpr auto Braille = makeBraille();
+
+constexpr uint32_t Pixel = HalfBlocks[2];
+constexpr uint32_t EmptyCell = HalfBlocks[0];
 
 inline ostream &concatImpl(ostream &ss) { return ss; }
 template <typename T, typename... Ts>
@@ -54,17 +185,17 @@ public:
     static const uint16_t ShadeOfGrayBase;
     static const uint16_t RGBBase;
 
+    // Colors are xterm palette indices, the terminal's own default color
+    // comes after them; ColorOutput maps them to termbox attributes
+    static constexpr uint16_t DefaultAttr = 0x100;
+
+    // channel value to the nearest level of the color cube
     static constexpr int toTerm(int c) noexcept
     {
-        if (c > 0xff) {
-            return 5;
-        } else if (c < 0) {
-            return 0;
-        } else {
-            return int(c * 6.0 / 256.0);
-        }
+        return CubeIndex[c < 0 ? 0 : c > 0xff ? 0xff : c];
     }
 
+    constexpr Color() noexcept = default;
     constexpr Color(uint16_t attr) noexcept : attr{attr} {}
     constexpr Color(uint16_t red, uint16_t green, uint16_t blue) noexcept
     {
@@ -74,9 +205,19 @@ public:
     {
         return attr;
     }
-    constexpr Color reversed() const noexcept
+    // The default color counts as black
+    constexpr Rgb toRgb() const noexcept
+    {
+        return Palette[attr & 0xff];
+    }
+
+    // Nearest cube color, or the nearest step of the gray ramp for grays
+    static constexpr Color fromRgb(Rgb rgb) noexcept
     {
-        return attr | TB_REVERSE;
+        if (rgb.r == rgb.g and rgb.g == rgb.b) {
+            return makeSOG(GrayIndex[rgb.r]);
+        }
+        return Color{rgb.r, rgb.g, rgb.b};
     }
 
 private:
@@ -91,7 +232,7 @@ private:
 public:
     static constexpr Color makeSOG(unsigned sog)
     {
-        if (sog > 0x100 - ShadeOfGrayBase) {
+        if (sog >= 0x100 - ShadeOfGrayBase) {
             return Color{0xff};
         } else {
             return Color{static_cast<uint16_t>(sog + ShadeOfGrayBase)};
@@ -100,8 +241,23 @@ public:
 
     friend constexpr Color operator + (const Color &, const Color &) noexcept;
 
+    // Mixes towards other by alpha out of 256, grays along the gray ramp and
+    // everything else through the palette
+    constexpr Color blend(Color other, unsigned alpha) const noexcept
+    {
+        if (isSOG() and other.isSOG()) {
+            int from = toSOG(), to = other.toSOG();
+            return makeSOG(from + ((to - from) * int(alpha) + 128) / 256);
+        }
+        auto a = toRgb(), b = other.toRgb();
+        auto mix = [alpha](int from, int to) {
+            return uint8_t(from + ((to - from) * int(alpha) + 128) / 256);
+        };
+        return fromRgb(Rgb{ mix(a.r, b.r), mix(a.g, b.g), mix(a.b, b.b) });
+    }
+
     template <typename T>
-    constexpr Color operator * (T n) noexcept
+    constexpr Color operator * (T n) const noexcept
     {
         if (isSOG()) {
             return makeSOG(toSOG() * n);
@@ -110,7 +266,7 @@ public:
         }
     }
     template <typename T>
-    constexpr Color operator / (T n) noexcept
+    constexpr Color operator / (T n) const noexcept
     {
         if (isSOG()) {
             return makeSOG(toSOG() / n);
@@ -119,7 +275,7 @@ public:
         }
     }
 private:
-    uint16_t attr = TB_DEFAULT;
+    uint16_t attr = DefaultAttr;
 };
 
 constexpr Color operator + (const Color &lhs, const Color &rhs) noexcept
@@ -131,413 +287,6532 @@ constexpr Color operator + (const Color &lhs, const Color &rhs) noexcept
     }
 }
 
-// TB_OUTPUT_256 messes up these colors
-constexpr Color Color::Default { TB_DEFAULT } ;
-constexpr Color Color::Black   { TB_WHITE   } ;
-constexpr Color Color::Red     { TB_BLACK   } ;
-constexpr Color Color::Green   { TB_RED     } ;
-constexpr Color Color::Yellow  { TB_GREEN   } ;
-constexpr Color Color::Blue    { TB_YELLOW  } ;
-constexpr Color Color::Magenta { TB_BLUE    } ;
-constexpr Color Color::Cyan    { TB_MAGENTA } ;
-constexpr Color Color::White   { TB_CYAN    } ;
+constexpr Color Color::Default { DefaultAttr } ;
+constexpr Color Color::Black   { 0 } ;
+constexpr Color Color::Red     { 1 } ;
+constexpr Color Color::Green   { 2 } ;
+constexpr Color Color::Yellow  { 3 } ;
+constexpr Color Color::Blue    { 4 } ;
+constexpr Color Color::Magenta { 5 } ;
+constexpr Color Color::Cyan    { 6 } ;
+constexpr Color Color::White   { 7 } ;
 constexpr uint16_t Color::ShadeOfGrayBase = 0xe8;
 constexpr uint16_t Color::RGBBase = 0x10;
 
 /******************************************************************************/
-/* Display                                                                     */
-
-class Display
-{
-public:
-    Display(size_t width, size_t height) : width{width}, height{height} {}
-    Display() : width{0}, height{0} {}
-
-    virtual void resize(size_t width, size_t height) = 0;
-
-    virtual void putPoint(int x, int y, Color color) = 0;
+/* ColorOutput                                                                */
 
-    virtual Color getPoint(int x, int y) const = 0;
+enum class OutputMode { Colors8, Cube216, Grayscale, Colors256, Count };
 
-    virtual void clear() = 0;
+// Half blocks show two pixels per cell, plain cells only the top one for
+// terminals without them
+enum class GlyphMode { HalfBlocks, Cells };
 
-    virtual void display() const = 0;
+// Foreground and background attribute per palette color and the default
+using RemapTable = std::array<uint16_t, Color::DefaultAttr + 1>;
 
-protected:
-    size_t width;
-    size_t height;
-};
+constexpr int rgbDistance(Rgb a, Rgb b) noexcept
+{
+    int dr = a.r - b.r, dg = a.g - b.g, db = a.b - b.b;
+    return dr * dr + dg * dg + db * db;
+}
 
-/******************************************************************************/
-/* Entities                                                                   */
+constexpr RemapTable makeRemapTable(OutputMode mode, bool background) noexcept
+{
+    RemapTable table{};
+    for (int i = 0; i < 256; i++) {
+        auto rgb = Palette[i];
+        switch (mode) {
+            case OutputMode::Colors8: {
+                // bright colors only exist as bold foregrounds
+                int best = 0, colors = background ? 8 : 16;
+                for (int c = 1; c < colors; c++) {
+                    if (rgbDistance(rgb, Palette[c]) < rgbDistance(rgb, Palette[best])) {
+                        best = c;
+                    }
+                }
+                table[i] = best < 8 ? TB_BLACK + best : (TB_BLACK + best - 8) | TB_BOLD;
+                break;
+            }
+            case OutputMode::Cube216:
+                table[i] = 36 * CubeIndex[rgb.r] + 6 * CubeIndex[rgb.g] + CubeIndex[rgb.b];
+                break;
+            case OutputMode::Grayscale:
+                table[i] = GrayIndex[(rgb.r * 77 + rgb.g * 150 + rgb.b * 29) >> 8];
+                break;
+            default:
+                // 0 means default to termbox, cube black looks the same
+                table[i] = i == 0 ? Color::RGBBase : i;
+                break;
+        }
+    }
+    // the reduced cube and gray modes have no default color
+    switch (mode) {
+        case OutputMode::Cube216:
+            table[Color::DefaultAttr] = background ? 0 : 215;
+            break;
+        case OutputMode::Grayscale:
+            table[Color::DefaultAttr] = background ? 0 : GrayLevels - 1;
+            break;
+        default:
+            table[Color::DefaultAttr] = TB_DEFAULT;
+            break;
+    }
+    return table;
+}
 
-template <typename CoordType>
-class Entity
+constexpr std::array<RemapTable, 2 * int(OutputMode::Count)> makeRemapTables() noexcept
 {
-public:
-    Entity(CoordType x, CoordType y) : x{x}, y{y} {}
-    virtual void draw(Display &) const = 0;
-    virtual void update() {}
-protected:
-    CoordType x, y;
-};
+    std::array<RemapTable, 2 * int(OutputMode::Count)> tables{};
+    for (int mode = 0; mode < int(OutputMode::Count); mode++) {
+        tables[2 * mode] = makeRemapTable(OutputMode(mode), false);
+        tables[2 * mode + 1] = makeRemapTable(OutputMode(mode), true);
+    }
+    return tables;
+}
 
-using IntEntity = Entity<int>;
+// Remap tables from palette colors to the termbox attributes of each output
+// mode, foreground and background, built at compile time
+constexpr auto RemapTables = makeRemapTables();
 
-template <typename CoordType>
-class Entities : public std::vector<uptr<Entity<CoordType> > >
+// Encodes palette colors for the selected output mode. The reduced modes send
+// shorter escape codes and, with fewer distinct colors, longer runs of equal
+// attributes.
+class ColorOutput
 {
 public:
-    using Entity = Entity<CoordType>;
-    void add(uptr<Entity> &&entity)
+    void select(OutputMode mode) noexcept
     {
-        this->push_back(move(entity));
+        this->mode = mode;
+        fgTable = &RemapTables[2 * int(mode)];
+        bgTable = &RemapTables[2 * int(mode) + 1];
     }
-};
 
-/******************************************************************************/
-/* Text                                                                       */
+    OutputMode getMode() const noexcept
+    {
+        return mode;
+    }
 
-class Text : public IntEntity
-{
-public:
-    template <typename TextType>
-    Text(int x, int y, TextType &&text, Color fg, Color bg)
-        : IntEntity{x, y}, text{forward<TextType>(text)}, fg{fg}, bg{bg} {}
+    void setGlyphs(GlyphMode glyphs) noexcept
+    {
+        this->glyphs = glyphs;
+    }
 
-    void draw(Display &) const override {}
+    GlyphMode getGlyphs() const noexcept
+    {
+        return glyphs;
+    }
 
-    void drawStraightToTermbox() const
+    int termboxMode() const noexcept
     {
-        int col = x;
-        for (auto &ch : text) {
-            tb_change_cell(col++, y, ch, fg, bg);
+        switch (mode) {
+            case OutputMode::Colors8:   return TB_OUTPUT_NORMAL;
+            case OutputMode::Cube216:   return TB_OUTPUT_216;
+            case OutputMode::Grayscale: return TB_OUTPUT_GRAYSCALE;
+            default:                    return TB_OUTPUT_256;
         }
     }
 
+    uint16_t fg(Color color) const noexcept
+    {
+        return (*fgTable)[std::min<uint16_t>(color, Color::DefaultAttr)];
+    }
+
+    uint16_t bg(Color color) const noexcept
+    {
+        return (*bgTable)[std::min<uint16_t>(color, Color::DefaultAttr)];
+    }
+
 private:
-    string text;
-    Color fg;
-    Color bg;
+    OutputMode mode = OutputMode::Colors256;
+    GlyphMode glyphs = GlyphMode::HalfBlocks;
+    const RemapTable *fgTable = &RemapTables[2 * int(OutputMode::Colors256)];
+    const RemapTable *bgTable = &RemapTables[2 * int(OutputMode::Colors256) + 1];
 };
 
+ColorOutput &colorOutput()
+{
+    static ColorOutput output;
+    return output;
+}
+
 /******************************************************************************/
-/* PixelDisplay                                                               */
+/* Fixed                                                                      */
 
-class PixelDisplay : public Display
+// 24.8 fixed point, for subpixel positions without floats in the rasterizers.
+// Converts implicitly from int, explicitly to and from float.
+class Fixed
 {
 public:
-    using Cells = std::valarray<Color>;
+    static constexpr int FracBits = 8;
+    static constexpr int32_t One = 1 << FracBits;
 
-public:
-    PixelDisplay(size_t width, size_t height)
-        : Display{width, height}, cells{Color::Default, width * height} {}
-    PixelDisplay() : Display{}, cells{} {}
+    constexpr Fixed() noexcept = default;
+    constexpr Fixed(int value) noexcept : raw{value * One} {}
+    explicit constexpr Fixed(float value) noexcept
+        : raw{int32_t(value * One + (value < 0 ? -0.5f : 0.5f))} {}
 
-    void resize(size_t width, size_t height) override
+    static constexpr Fixed fromRaw(int32_t raw) noexcept
     {
-        this->width = width;
-        this->height = height * 2;
-        cells.resize(this->width * this->height, Color::Default);
+        Fixed f;
+        f.raw = raw;
+        return f;
     }
-
-    void putPoint(int x, int y, Color color) override
+    constexpr int32_t getRaw() const noexcept
     {
-        if (x < 0 or y < 0 or x >= width or y >= height) {
-            return;
-        }
-        cells[getIndex(x, y)] = color;
+        return raw;
     }
 
-    Color getPoint(int x, int y) const override
+    constexpr int floor() const noexcept { return raw >> FracBits; }
+    constexpr int ceil() const noexcept { return (raw + One - 1) >> FracBits; }
+    constexpr int round() const noexcept { return (raw + One / 2) >> FracBits; }
+    constexpr int32_t frac() const noexcept { return raw & (One - 1); }
+    explicit constexpr operator float() const noexcept
     {
-        if (x < 0 or y < 0 or x >= width or y >= height) {
-            return Color::Default;
-        }
-        return cells[getIndex(x, y)];
+        return raw / float(One);
     }
 
-    void clear() override
+    constexpr Fixed operator - () const noexcept { return fromRaw(-raw); }
+    constexpr Fixed &operator += (Fixed o) noexcept { raw += o.raw; return *this; }
+    constexpr Fixed &operator -= (Fixed o) noexcept { raw -= o.raw; return *this; }
+    constexpr Fixed &operator *= (Fixed o) noexcept { return *this = *this * o; }
+    constexpr Fixed &operator /= (Fixed o) noexcept { return *this = *this / o; }
+
+    friend constexpr Fixed operator + (Fixed a, Fixed b) noexcept { return fromRaw(a.raw + b.raw); }
+    friend constexpr Fixed operator - (Fixed a, Fixed b) noexcept { return fromRaw(a.raw - b.raw); }
+    friend constexpr Fixed operator * (Fixed a, Fixed b) noexcept
     {
-        for (auto &c : cells) {
-            c = Color::Default;
-        }
+        return fromRaw(int32_t((int64_t(a.raw) * b.raw) >> FracBits));
     }
-
-    void drawSize() const
+    friend constexpr Fixed operator / (Fixed a, Fixed b) noexcept
     {
-        auto sizeText = concat(width, 'x', height);
-        int textCol = width - sizeText.size();
-        Text t{textCol, 0, sizeText, Color::White, Color::Black};
-        t.drawStraightToTermbox();
+        return fromRaw(int32_t((int64_t(a.raw) << FracBits) / b.raw));
     }
+    friend constexpr bool operator == (Fixed a, Fixed b) noexcept = default;
+    friend constexpr auto operator <=> (Fixed a, Fixed b) noexcept = default;
 
-    void display() const override
+    static constexpr Fixed abs(Fixed f) noexcept
     {
-        for (int col = 0; col < width; col++) {
-            for (int row = 0; row < height; row += 2)
-            {
-                auto top = getPoint(col, row);
-                auto bot = getPoint(col, row + 1);
-                if (bot == Color::Default) {
-                    if (bot == top) {
-                        tb_change_cell(col, row / 2, EmptyCell, bot, top);
-                    } else {
-                        tb_change_cell(col, row / 2, Pixel, top.reversed(), bot);
-                    }
-                } else {
-                    tb_change_cell(col, row / 2, Pixel, bot, top);
-                }
-            }
-        }
-        drawSize();
+        return fromRaw(f.raw < 0 ? -f.raw : f.raw);
     }
 
-private:
-    constexpr size_t getIndex(int x, int y) const noexcept
+    // Integer square root, exact to the last fractional bit
+    static constexpr Fixed sqrt(Fixed f) noexcept
     {
-        return y * width + x;
+        if (f.raw <= 0) {
+            return Fixed{};
+        }
+        uint64_t n = uint64_t(f.raw) << FracBits, root = 0;
+        uint64_t bit = uint64_t(1) << 62;
+        while (bit > n) {
+            bit >>= 2;
+        }
+        while (bit != 0) {
+            if (n >= root + bit) {
+                n -= root + bit;
+                root = (root >> 1) + bit;
+            } else {
+                root >>= 1;
+            }
+            bit >>= 2;
+        }
+        return fromRaw(int32_t(root));
     }
 
 private:
-    Cells cells;
+    int32_t raw = 0;
 };
 
 /******************************************************************************/
-/* Point                                                                      */
+/* Rect                                                                       */
 
-class Point : public IntEntity
+struct Rect
 {
-public:
-    Point(int x, int y, Color color) : IntEntity{x, y}, color{color} {}
+    int x = 0, y = 0, w = 0, h = 0;
 
-    void update() override {}
-    void draw(Display &display) const override
+    constexpr int right() const noexcept { return x + w; }
+    constexpr int bottom() const noexcept { return y + h; }
+    constexpr bool empty() const noexcept { return w <= 0 or h <= 0; }
+
+    constexpr bool intersects(const Rect &o) const noexcept
     {
-        display.putPoint(x, y, color);
+        return x < o.right() and o.x < right() and y < o.bottom() and o.y < bottom();
+    }
+
+    constexpr Rect united(const Rect &o) const noexcept
+    {
+        if (empty()) {
+            return o;
+        } else if (o.empty()) {
+            return *this;
+        }
+        int l = std::min(x, o.x), t = std::min(y, o.y);
+        return Rect{l, t, std::max(right(), o.right()) - l,
+                    std::max(bottom(), o.bottom()) - t};
+    }
+
+    constexpr Rect intersected(const Rect &o) const noexcept
+    {
+        int l = std::max(x, o.x), t = std::max(y, o.y);
+        int r = std::min(right(), o.right()), b = std::min(bottom(), o.bottom());
+        if (r <= l or b <= t) {
+            return Rect{};
+        }
+        return Rect{l, t, r - l, b - t};
+    }
+
+    constexpr bool operator == (const Rect &o) const noexcept
+    {
+        return x == o.x and y == o.y and w == o.w and h == o.h;
+    }
+    constexpr bool operator != (const Rect &o) const noexcept
+    {
+        return not (*this == o);
     }
-private:
-    Color color = Color::White;
 };
 
 /******************************************************************************/
-/* Screen                                                                     */
+/* Damage                                                                     */
 
-class Screen
+// Regions of the display that changed since the last frame. Only these are
+// cleared, redrawn and sent to termbox. Neighbouring rects are merged as they
+// come in, and once there are too many of them they collapse into their
+// bounding box.
+class Damage
 {
 public:
-    Screen(uptr<Display> &&display) : entities{}, display{move(display)} {}
-    void resize(size_t width, size_t height)
+    static constexpr size_t MaxRects = 64;
+
+    void add(const Rect &r)
     {
-        display->resize(width, height);
+        if (all or r.empty()) {
+            return;
+        }
+        if (not rects.empty() and merge(rects.back(), r)) {
+            return;
+        }
+        if (rects.size() == MaxRects) {
+            Rect b = bounds().united(r);
+            rects.clear();
+            rects.push_back(b);
+            return;
+        }
+        rects.push_back(r);
     }
 
-    void update()
+    void addAll()
     {
-        for (auto &e : entities) {
-            e->update();
-        }
+        all = true;
+        rects.clear();
     }
 
-    void drawSize()
+    void clear()
     {
-        auto sizeText = concat(tb_width(), 'x', tb_height());
-        Text t{0, 0, sizeText, Color::White, Color::Black};
-        t.drawStraightToTermbox();
+        all = false;
+        rects.clear();
     }
 
-    void draw()
+    bool empty() const noexcept
     {
-        display->clear();
-        for (auto &e : entities) {
-            e->draw(*display);
-        }
-        display->display();
-        drawSize();
+        return not all and rects.empty();
     }
 
-    using Entities = Entities<int>;
-    void addEntity(uptr<Entities::Entity> &&entity)
+    bool isAll() const noexcept
     {
-        entities.add(move(entity));
+        return all;
     }
 
-    void setDisplay(uptr<Display> &&display)
+    const vector<Rect> &getRects() const noexcept
     {
-        this->display = move(display);
+        return rects;
+    }
+
+    Rect bounds() const noexcept
+    {
+        Rect b;
+        for (auto &r : rects) {
+            b = b.united(r);
+        }
+        return b;
     }
 
 private:
-    Entities entities;
-    uptr<Display> display;
+    static bool merge(Rect &last, const Rect &r) noexcept
+    {
+        if (last.x == r.x and last.w == r.w
+                and r.y <= last.bottom() and last.y <= r.bottom()) {
+            last = last.united(r);
+            return true;
+        }
+        if (last.y == r.y and last.h == r.h
+                and r.x <= last.right() and last.x <= r.right()) {
+            last = last.united(r);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    vector<Rect> rects;
+    bool all = false;
 };
 
 /******************************************************************************/
-/* Termbox                                                                    */
+/* ThreadPool                                                                 */
 
-class Termbox
+class ThreadPool
 {
 public:
-    bool init()
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
     {
-        if (auto res = tb_init()) {
-            cerr << "tb_init() failed with error code " << res << endl;
-            return false;
+        for (unsigned i = 1; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
         }
-        tb_select_input_mode(TB_INPUT_ALT | TB_INPUT_MOUSE);
-        tb_select_output_mode(TB_OUTPUT_256);
-        tb_set_clear_attributes(Color::White, Color::Black);
-        return true;
     }
 
-    ~Termbox()
+    ~ThreadPool()
     {
-        tb_shutdown();
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    // The calling thread counts as one of the workers
+    size_t size() const noexcept
+    {
+        return workers.size() + 1;
+    }
+
+    // Calls f(from, to) over disjoint chunks covering [begin, end) and returns
+    // once all of them are done
+    template <typename F>
+    void parallelFor(size_t begin, size_t end, F &&f)
+    {
+        const size_t count = end > begin ? end - begin : 0;
+        const size_t chunks = std::min(count, size() * 4);
+        if (chunks <= 1) {
+            if (count) {
+                f(begin, end);
+            }
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        auto run = [&] {
+            for (size_t c; (c = next++) < chunks;) {
+                f(begin + count * c / chunks, begin + count * (c + 1) / chunks);
+            }
+        };
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            for (size_t i = 0; i < workers.size(); i++) {
+                tasks.push_back(run);
+            }
+            pending += workers.size();
+        }
+        wakeup.notify_all();
+        run();
+
+        // every queued task refers to this stack frame, so wait for all of them
+        // to be picked up, not just for the chunks to run out
+        std::unique_lock<std::mutex> lock{mutex};
+        finished.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    void work()
+    {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                wakeup.wait(lock, [this] { return stopping or not tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+            std::lock_guard<std::mutex> lock{mutex};
+            if (--pending == 0) {
+                finished.notify_all();
+            }
+        }
+    }
+
+private:
+    vector<std::thread> workers;
+    std::deque<std::function<void()> > tasks;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable finished;
+    size_t pending = 0;
+    bool stopping = false;
+};
+
+ThreadPool &threadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+/******************************************************************************/
+/* Screenshots                                                                */
+
+// Copy of a display's pixels, cheap enough to take in the middle of a frame
+struct Snapshot
+{
+    int width = 0, height = 0;
+    vector<Color> pixels;
+};
+
+constexpr std::array<uint32_t, 256> makeCrcTable() noexcept
+{
+    std::array<uint32_t, 256> table{};
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[n] = c;
+    }
+    return table;
+}
+
+constexpr auto CrcTable = makeCrcTable();
+
+// Deflate with LZ77 over hash chains and the fixed Huffman codes, enough for
+// screenshots which are long runs of few colors
+class Deflate
+{
+public:
+    static string compress(const string &data)
+    {
+        Deflate d;
+        d.put(1, 1);    // final block
+        d.put(1, 2);    // fixed Huffman codes
+        vector<int32_t> head(HashSize, -1), prev(data.size());
+        const auto *p = reinterpret_cast<const uint8_t *>(data.data());
+        const int32_t n = data.size();
+        for (int32_t i = 0; i < n;) {
+            int bestLen = 0, bestDist = 0;
+            if (i + MinMatch <= n) {
+                auto h = hash(p + i);
+                int chain = MaxChain;
+                for (int32_t j = head[h]; j >= 0 and i - j <= Window and chain--; j = prev[j]) {
+                    int len = 0, max = std::min(MaxMatch, n - i);
+                    while (len < max and p[j + len] == p[i + len]) {
+                        len++;
+                    }
+                    if (len > bestLen) {
+                        bestLen = len;
+                        bestDist = i - j;
+                        if (len == max) {
+                            break;
+                        }
+                    }
+                }
+            }
+            if (bestLen >= MinMatch) {
+                d.match(bestLen, bestDist);
+            } else {
+                bestLen = 1;
+                d.literal(p[i]);
+            }
+            for (int k = 0; k < bestLen; k++, i++) {
+                if (i + MinMatch <= n) {
+                    auto h = hash(p + i);
+                    prev[i] = head[h];
+                    head[h] = i;
+                }
+            }
+        }
+        d.literal(256);     // end of block
+        d.flush();
+        return move(d.out);
+    }
+
+private:
+    static constexpr int MinMatch = 3;
+    static constexpr int MaxMatch = 258;
+    static constexpr int Window = 32768;
+    static constexpr int MaxChain = 32;
+    static constexpr int HashSize = 1 << 15;
+
+    static constexpr uint16_t LengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static constexpr uint8_t LengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static constexpr uint16_t DistBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289,
+        16385, 24577 };
+    static constexpr uint8_t DistExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    static uint32_t hash(const uint8_t *p) noexcept
+    {
+        return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - 15);
+    }
+
+    // bits go out least significant first
+    void put(uint32_t value, int count)
+    {
+        bits |= uint64_t(value) << bitCount;
+        bitCount += count;
+        while (bitCount >= 8) {
+            out.push_back(char(bits & 0xff));
+            bits >>= 8;
+            bitCount -= 8;
+        }
+    }
+
+    // Huffman codes go out most significant first
+    void putCode(uint32_t code, int length)
+    {
+        uint32_t reversed = 0;
+        for (int i = 0; i < length; i++) {
+            reversed |= ((code >> i) & 1) << (length - 1 - i);
+        }
+        put(reversed, length);
+    }
+
+    void literal(int value)
+    {
+        if (value < 144) {
+            putCode(0x30 + value, 8);
+        } else if (value < 256) {
+            putCode(0x190 + value - 144, 9);
+        } else if (value < 280) {
+            putCode(value - 256, 7);
+        } else {
+            putCode(0xc0 + value - 280, 8);
+        }
+    }
+
+    void match(int length, int distance)
+    {
+        int l = 28;
+        while (LengthBase[l] > length) {
+            l--;
+        }
+        literal(257 + l);
+        put(length - LengthBase[l], LengthExtra[l]);
+        int d = 29;
+        while (DistBase[d] > distance) {
+            d--;
+        }
+        putCode(d, 5);
+        put(distance - DistBase[d], DistExtra[d]);
+    }
+
+    void flush()
+    {
+        if (bitCount > 0) {
+            put(0, 8 - bitCount);
+        }
+    }
+
+    string out;
+    uint64_t bits = 0;
+    int bitCount = 0;
+};
+
+class ImageEncoder
+{
+public:
+    // binary PPM, the palette expanded to RGB
+    static string ppm(const Snapshot &shot)
+    {
+        auto data = concat("P6\n", shot.width, ' ', shot.height, "\n255\n");
+        auto header = data.size();
+        data.resize(header + shot.pixels.size() * 3);
+        auto *p = &data[header];
+        for (auto color : shot.pixels) {
+            auto rgb = color.toRgb();
+            *p++ = char(rgb.r);
+            *p++ = char(rgb.g);
+            *p++ = char(rgb.b);
+        }
+        return data;
+    }
+
+    // indexed color PNG with the xterm palette, a byte per pixel
+    static string png(const Snapshot &shot)
+    {
+        string raw;
+        raw.reserve((shot.width + 1) * shot.height);
+        for (int y = 0; y < shot.height; y++) {
+            raw.push_back(0);   // no filter
+            for (int x = 0; x < shot.width; x++) {
+                raw.push_back(char(uint16_t(shot.pixels[y * shot.width + x]) & 0xff));
+            }
+        }
+
+        string data = "\x89PNG\r\n\x1a\n";
+        string header;
+        putBE(header, shot.width);
+        putBE(header, shot.height);
+        header += string{"\x08\x03\x00\x00\x00", 5};    // 8 bit indexed
+        chunk(data, "IHDR", header);
+
+        string palette;
+        for (auto rgb : Palette) {
+            palette += char(rgb.r);
+            palette += char(rgb.g);
+            palette += char(rgb.b);
+        }
+        chunk(data, "PLTE", palette);
+
+        string zlib = "\x78\x01";
+        zlib += Deflate::compress(raw);
+        putBE(zlib, adler32(raw));
+        chunk(data, "IDAT", zlib);
+        chunk(data, "IEND", "");
+        return data;
+    }
+
+private:
+    static void putBE(string &s, uint32_t v)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            s += char((v >> shift) & 0xff);
+        }
+    }
+
+    static void chunk(string &out, const char *type, const string &body)
+    {
+        putBE(out, body.size());
+        auto start = out.size();
+        out += type;
+        out += body;
+        uint32_t crc = 0xffffffffu;
+        for (auto i = start; i < out.size(); i++) {
+            crc = CrcTable[(crc ^ uint8_t(out[i])) & 0xff] ^ (crc >> 8);
+        }
+        putBE(out, crc ^ 0xffffffffu);
+    }
+
+    static uint32_t adler32(const string &data)
+    {
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < data.size();) {
+            // largest run before the sums may overflow
+            auto end = std::min(data.size(), i + 5552);
+            for (; i < end; i++) {
+                a += uint8_t(data[i]);
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return b << 16 | a;
+    }
+};
+
+// Encodes and writes snapshots on a thread of its own, so the frame that took
+// the snapshot only pays for the copy
+class ScreenshotWriter
+{
+public:
+    ScreenshotWriter() : worker{[this] { run(); }} {}
+
+    ~ScreenshotWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // The format follows the extension: .ppm, anything else is PNG
+    void save(Snapshot shot, string path)
+    {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            queue.push_back({ move(shot), move(path) });
+        }
+        wake.notify_one();
+    }
+
+private:
+    struct Job
+    {
+        Snapshot shot;
+        string path;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock{mutex};
+        for (;;) {
+            wake.wait(lock, [this] { return stopping or not queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            auto job = move(queue.front());
+            queue.pop_front();
+            lock.unlock();
+            auto ppm = job.path.size() >= 4
+                and job.path.compare(job.path.size() - 4, 4, ".ppm") == 0;
+            auto data = ppm ? ImageEncoder::ppm(job.shot) : ImageEncoder::png(job.shot);
+            std::ofstream{job.path, std::ios::binary}.write(data.data(), data.size());
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Job> queue;
+    bool stopping = false;
+    std::thread worker;
+};
+
+ScreenshotWriter &screenshotWriter()
+{
+    static ScreenshotWriter writer;
+    return writer;
+}
+
+/******************************************************************************/
+/* Display                                                                     */
+
+class Display
+{
+public:
+    Display(size_t width, size_t height) : width{width}, height{height} {}
+    Display() : width{0}, height{0} {}
+
+    virtual void resize(size_t width, size_t height) = 0;
+
+    virtual void putPoint(int x, int y, Color color) = 0;
+
+    virtual void putPoints(const int *xs, const int *ys, const Color *colors,
+                           size_t count)
+    {
+        for (size_t i = 0; i < count; i++) {
+            putPoint(xs[i], ys[i], colors[i]);
+        }
+    }
+
+    // Copies a w x h block of pixels, rows `stride` colors apart
+    virtual void blit(int x, int y, int w, int h, const Color *pixels,
+                      size_t stride)
+    {
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                putPoint(x + col, y + row, pixels[row * stride + col]);
+            }
+        }
+    }
+
+    // Like blit, but only pixels with a non-zero mask byte are copied
+    virtual void blitMasked(int x, int y, int w, int h, const Color *pixels,
+                            const uint8_t *mask, size_t stride)
+    {
+        for (int row = 0; row < h; row++) {
+            for (int col = 0; col < w; col++) {
+                if (mask[row * stride + col]) {
+                    putPoint(x + col, y + row, pixels[row * stride + col]);
+                }
+            }
+        }
+    }
+
+    virtual Color getPoint(int x, int y) const = 0;
+
+    // Copies out all pixels, displays without a framebuffer have none
+    virtual bool snapshot(Snapshot &) const { return false; }
+
+    virtual void clear() = 0;
+
+    // Clears only the damaged regions and limits drawing to their bounds
+    virtual void clear(const Damage &damage) = 0;
+
+    virtual void display() const = 0;
+
+    virtual void display(const Damage &damage) const = 0;
+
+    // Entities may skip the parts of themselves outside this rect
+    const Rect &getClip() const noexcept
+    {
+        return clip;
+    }
+
+protected:
+    size_t width;
+    size_t height;
+    Rect clip;
+};
+
+/******************************************************************************/
+/* Entities                                                                   */
+
+// Entity fields that can be animated. Gray writes a Color through the shade
+// of gray ramp, everything else is a plain int.
+enum class Property { X, Y, Radius, Gray };
+
+struct PropertyRef
+{
+    int *value = nullptr;
+    Color *color = nullptr;
+    Fixed *fixed = nullptr;
+};
+
+struct MouseEvent
+{
+    int x, y;       // in display pixels
+    unsigned key;   // TB_KEY_MOUSE_*
+};
+
+// What the screen and its systems need from an entity, whatever its
+// coordinate type
+class EntityBase
+{
+public:
+    virtual ~EntityBase() = default;
+    virtual void draw(Display &) const = 0;
+    virtual void update() {}
+
+    // Entities that do nothing in update() can opt out of being called every
+    // frame; they can still be driven by behaviors and animations
+    virtual bool wantsUpdate() const { return true; }
+
+    // Entities that can trade quality for time have several levels, 0 being
+    // the best; see FrameBudget
+    virtual int qualityLevels() const { return 1; }
+    virtual void setQuality(int) {}
+
+    // Bounding box in display pixels, entities without one never collide
+    virtual bool getBounds(Rect &) const { return false; }
+    virtual void onCollision(EntityBase &) {}
+
+    // Only entities asking for it get mouse events
+    virtual bool wantsMouse() const { return false; }
+    virtual void onMouse(const MouseEvent &) {}
+
+    // Adds the regions that changed since the last draw. Without knowing better
+    // the whole display has to be redrawn.
+    virtual void collectDamage(Damage &damage) { damage.addAll(); }
+
+    virtual PropertyRef getProperty(Property) { return PropertyRef{}; }
+};
+
+template <typename CoordType>
+class Entity : public EntityBase
+{
+public:
+    Entity(CoordType x, CoordType y) : x{x}, y{y} {}
+
+    PropertyRef getProperty(Property property) override
+    {
+        if (property != Property::X and property != Property::Y) {
+            return PropertyRef{};
+        }
+        auto *coord = property == Property::X ? &x : &y;
+        if constexpr (std::is_same<CoordType, int>::value) {
+            return PropertyRef{coord};
+        } else if constexpr (std::is_same<CoordType, Fixed>::value) {
+            return PropertyRef{nullptr, nullptr, coord};
+        } else {
+            return PropertyRef{};
+        }
+    }
+protected:
+    CoordType x, y;
+};
+
+using IntEntity = Entity<int>;
+using FixedEntity = Entity<Fixed>;
+
+class Entities : public std::vector<uptr<EntityBase> >
+{
+public:
+    using Entity = EntityBase;
+    void add(uptr<Entity> &&entity)
+    {
+        this->push_back(move(entity));
+    }
+};
+
+/******************************************************************************/
+/* Text                                                                       */
+
+class Text : public IntEntity
+{
+public:
+    template <typename TextType>
+    Text(int x, int y, TextType &&text, Color fg, Color bg)
+        : IntEntity{x, y}, text{forward<TextType>(text)}, fg{fg}, bg{bg} {}
+
+    void draw(Display &) const override {}
+
+    void drawStraightToTermbox() const
+    {
+        int col = x;
+        for (auto &ch : text) {
+            tb_change_cell(col++, y, ch, colorOutput().fg(fg), colorOutput().bg(bg));
+        }
+    }
+
+private:
+    string text;
+    Color fg;
+    Color bg;
+};
+
+/******************************************************************************/
+/* PixelDisplay                                                               */
+
+class PixelDisplay : public Display
+{
+public:
+    using Cells = std::valarray<Color>;
+
+public:
+    PixelDisplay(size_t width, size_t height)
+        : Display{width, height}, cells{Color::Default, width * height} {}
+    PixelDisplay() : Display{}, cells{} {}
+
+    void resize(size_t width, size_t height) override
+    {
+        this->width = width;
+        this->height = height * 2;
+        cells.resize(this->width * this->height, Color::Default);
+        clip = getRect();
+    }
+
+    void putPoint(int x, int y, Color color) override
+    {
+        if (x < clip.x or y < clip.y or x >= clip.right() or y >= clip.bottom()) {
+            return;
+        }
+        cells[getIndex(x, y)] = color;
+    }
+
+    void putPoints(const int *xs, const int *ys, const Color *colors,
+                   size_t count) override
+    {
+        const unsigned w = clip.w, h = clip.h;
+        for (size_t i = 0; i < count; i++) {
+            // negative offsets wrap around and fail the unsigned check
+            if (unsigned(xs[i] - clip.x) < w and unsigned(ys[i] - clip.y) < h) {
+                cells[getIndex(xs[i], ys[i])] = colors[i];
+            }
+        }
+    }
+
+    void blit(int x, int y, int w, int h, const Color *pixels,
+              size_t stride) override
+    {
+        auto area = Rect{x, y, w, h}.intersected(clip);
+        if (area.empty()) {
+            return;
+        }
+        const Color *src = pixels + (area.y - y) * stride + (area.x - x);
+        for (int row = area.y; row < area.bottom(); row++, src += stride) {
+            std::copy(src, src + area.w, &cells[getIndex(area.x, row)]);
+        }
+    }
+
+    void blitMasked(int x, int y, int w, int h, const Color *pixels,
+                    const uint8_t *mask, size_t stride) override
+    {
+        auto area = Rect{x, y, w, h}.intersected(clip);
+        if (area.empty()) {
+            return;
+        }
+        size_t offset = (area.y - y) * stride + (area.x - x);
+        const Color *src = pixels + offset;
+        const uint8_t *m = mask + offset;
+        for (int row = area.y; row < area.bottom(); row++, src += stride, m += stride) {
+            Color *dst = &cells[getIndex(area.x, row)];
+            // a branch-free select, which compiles to a vector blend
+            for (int i = 0; i < area.w; i++) {
+                dst[i] = m[i] ? src[i] : dst[i];
+            }
+        }
+    }
+
+    bool snapshot(Snapshot &shot) const override
+    {
+        shot.width = width;
+        shot.height = height;
+        shot.pixels.assign(std::begin(cells), std::end(cells));
+        return true;
+    }
+
+    Color getPoint(int x, int y) const override
+    {
+        if (x < 0 or y < 0 or x >= width or y >= height) {
+            return Color::Default;
+        }
+        return cells[getIndex(x, y)];
+    }
+
+    void clear() override
+    {
+        for (auto &c : cells) {
+            c = Color::Default;
+        }
+        clip = getRect();
+    }
+
+    void clear(const Damage &damage) override
+    {
+        if (damage.isAll()) {
+            clear();
+            return;
+        }
+        for (auto &r : damage.getRects()) {
+            auto area = r.intersected(getRect());
+            for (int row = area.y; row < area.bottom(); row++) {
+                auto *line = &cells[getIndex(area.x, row)];
+                std::fill(line, line + area.w, Color::Default);
+            }
+        }
+        clip = damage.bounds().intersected(getRect());
+    }
+
+    void drawSize() const
+    {
+        auto sizeText = concat(width, 'x', height);
+        int textCol = width - sizeText.size();
+        Text t{textCol, 0, sizeText, Color::White, Color::Black};
+        t.drawStraightToTermbox();
+    }
+
+    void display() const override
+    {
+        displayArea(getRect());
+        drawSize();
+    }
+
+    void display(const Damage &damage) const override
+    {
+        if (damage.isAll()) {
+            display();
+            return;
+        }
+        for (auto &r : damage.getRects()) {
+            displayArea(r);
+        }
+        drawSize();
+    }
+
+private:
+    constexpr size_t getIndex(int x, int y) const noexcept
+    {
+        return y * width + x;
+    }
+
+    Rect getRect() const noexcept
+    {
+        return Rect{0, 0, int(width), int(height)};
+    }
+
+    // Sends the cells covering the pixels of area to termbox
+    void displayArea(const Rect &area) const
+    {
+        auto r = area.intersected(getRect());
+        auto &out = colorOutput();
+        for (int col = r.x; col < r.right(); col++) {
+            for (int row = r.y & ~1; row < r.bottom(); row += 2)
+            {
+                auto top = getPoint(col, row);
+                auto bot = getPoint(col, row + 1);
+                if (out.getGlyphs() == GlyphMode::Cells) {
+                    auto shown = top == Color::Default ? bot : top;
+                    tb_change_cell(col, row / 2, EmptyCell, out.fg(shown), out.bg(shown));
+                } else if (bot == Color::Default) {
+                    if (bot == top) {
+                        tb_change_cell(col, row / 2, EmptyCell, out.fg(bot), out.bg(top));
+                    } else {
+                        tb_change_cell(col, row / 2, Pixel,
+                                       out.fg(top) | TB_REVERSE, out.bg(bot));
+                    }
+                } else {
+                    tb_change_cell(col, row / 2, Pixel, out.fg(bot), out.bg(top));
+                }
+            }
+        }
+    }
+
+private:
+    Cells cells;
+};
+
+/******************************************************************************/
+/* TranslatedDisplay                                                          */
+
+// Draws into another display shifted by (dx, dy), so entities positioned in a
+// local coordinate space can be drawn unchanged
+class TranslatedDisplay : public Display
+{
+public:
+    TranslatedDisplay(Display &target, int dx, int dy)
+        : Display{}, target{target}, dx{dx}, dy{dy}
+    {
+        auto &c = target.getClip();
+        clip = Rect{c.x - dx, c.y - dy, c.w, c.h};
+    }
+
+    void resize(size_t, size_t) override {}
+
+    void putPoint(int x, int y, Color color) override
+    {
+        target.putPoint(x + dx, y + dy, color);
+    }
+
+    void blit(int x, int y, int w, int h, const Color *pixels,
+              size_t stride) override
+    {
+        target.blit(x + dx, y + dy, w, h, pixels, stride);
+    }
+
+    void blitMasked(int x, int y, int w, int h, const Color *pixels,
+                    const uint8_t *mask, size_t stride) override
+    {
+        target.blitMasked(x + dx, y + dy, w, h, pixels, mask, stride);
+    }
+
+    Color getPoint(int x, int y) const override
+    {
+        return target.getPoint(x + dx, y + dy);
+    }
+
+    void clear() override {}
+    void clear(const Damage &) override {}
+    void display() const override {}
+    void display(const Damage &) const override {}
+
+private:
+    Display &target;
+    int dx, dy;
+};
+
+/******************************************************************************/
+/* Bitmap                                                                     */
+
+// Pixels with a transparency mask. Each row remembers the span between its
+// first and last opaque pixel and whether everything in it is opaque: such
+// rows are drawn with a plain copy, the rest with a masked blit.
+class Bitmap
+{
+public:
+    Bitmap() = default;
+    Bitmap(int width, int height, vector<Color> pixels, vector<uint8_t> mask)
+        : width{width}, height{height}, pixels{move(pixels)}, mask{move(mask)}
+    {
+        for (int row = 0; row < height; row++) {
+            const uint8_t *m = &this->mask[row * width];
+            Row info;
+            while (info.begin < width and not m[info.begin]) {
+                info.begin++;
+            }
+            info.end = width;
+            while (info.end > info.begin and not m[info.end - 1]) {
+                info.end--;
+            }
+            info.opaque = std::all_of(m + info.begin, m + info.end,
+                                      [](uint8_t v) { return v != 0; });
+            rows.push_back(info);
+        }
+    }
+
+    int getWidth() const noexcept
+    {
+        return width;
+    }
+
+    int getHeight() const noexcept
+    {
+        return height;
+    }
+
+    void draw(Display &display, int x, int y) const
+    {
+        for (int row = 0; row < height; row++) {
+            auto &r = rows[row];
+            if (r.begin == r.end) {
+                continue;
+            }
+            size_t offset = row * width + r.begin;
+            if (r.opaque) {
+                display.blit(x + r.begin, y + row, r.end - r.begin, 1,
+                             &pixels[offset], width);
+            } else {
+                display.blitMasked(x + r.begin, y + row, r.end - r.begin, 1,
+                                   &pixels[offset], &mask[offset], width);
+            }
+        }
+    }
+
+    static Bitmap circle(int radius, Color color)
+    {
+        int size = std::max(2 * radius + 1, 0);
+        vector<Color> pixels(size * size, color);
+        vector<uint8_t> mask(size * size);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int dx = x - radius, dy = y - radius;
+                mask[y * size + x] = dx * dx + dy * dy <= radius * radius;
+            }
+        }
+        return Bitmap{size, size, move(pixels), move(mask)};
+    }
+
+    // One string per row, characters missing from the palette are transparent
+    static Bitmap fromText(const vector<string> &text,
+                           const std::map<char, Color> &palette)
+    {
+        int h = text.size(), w = 0;
+        for (auto &line : text) {
+            w = std::max(w, int(line.size()));
+        }
+        vector<Color> pixels(w * h);
+        vector<uint8_t> mask(w * h);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < int(text[y].size()); x++) {
+                auto it = palette.find(text[y][x]);
+                if (it != palette.end()) {
+                    pixels[y * w + x] = it->second;
+                    mask[y * w + x] = 1;
+                }
+            }
+        }
+        return Bitmap{w, h, move(pixels), move(mask)};
+    }
+
+private:
+    struct Row
+    {
+        int begin = 0, end = 0;
+        bool opaque = false;
+    };
+
+    int width = 0, height = 0;
+    vector<Color> pixels;
+    vector<uint8_t> mask;
+    vector<Row> rows;
+};
+
+/******************************************************************************/
+/* SpriteSheet                                                                */
+
+// Animation frames shared by every sprite showing them
+struct SpriteSheet
+{
+    vector<Bitmap> frames;
+    std::chrono::milliseconds frameTime{100};
+};
+
+using SpriteSheetPtr = std::shared_ptr<const SpriteSheet>;
+
+/******************************************************************************/
+/* Point                                                                      */
+
+class Point : public IntEntity
+{
+public:
+    Point(int x, int y, Color color) : IntEntity{x, y}, color{color} {}
+
+    void update() override {}
+    bool wantsUpdate() const override { return false; }
+    void draw(Display &display) const override
+    {
+        display.putPoint(x, y, color);
+        drawn = Rect{x, y, 1, 1};
+        drawnColor = color;
+    }
+    void collectDamage(Damage &damage) override
+    {
+        if (drawn != Rect{x, y, 1, 1} or color != drawnColor) {
+            damage.add(drawn);
+            damage.add(Rect{x, y, 1, 1});
+        }
+    }
+    PropertyRef getProperty(Property property) override
+    {
+        if (property == Property::Gray) {
+            return PropertyRef{nullptr, &color};
+        }
+        return IntEntity::getProperty(property);
+    }
+private:
+    Color color = Color::White;
+
+    mutable Rect drawn;
+    mutable Color drawnColor = Color::Default;
+};
+
+/******************************************************************************/
+/* Collisions                                                                 */
+
+// Broad phase over entity bounding boxes. The spatial hash is kept between
+// frames and an entity is only rehashed when it crosses a cell boundary;
+// sweep-and-prune keeps its x-sorted order between frames for the same reason.
+class CollisionSystem
+{
+public:
+    enum class Method { SpatialHash, SweepAndPrune };
+
+    explicit CollisionSystem(Method method = Method::SpatialHash, int cellSize = 8)
+        : method{method}, cellSize{cellSize} {}
+
+    void update(Entities &entities)
+    {
+        if (proxies.size() > entities.size()) {
+            reset();
+        }
+        while (proxies.size() < entities.size()) {
+            proxies.push_back(Proxy{});
+        }
+        for (size_t i = 0; i < entities.size(); i++) {
+            auto &p = proxies[i];
+            p.entity = entities[i].get();
+            p.active = p.entity->getBounds(p.bounds) and not p.bounds.empty();
+        }
+        switch (method) {
+            case Method::SpatialHash:
+                updateHash();
+                break;
+            case Method::SweepAndPrune:
+                sweepAndPrune();
+                break;
+        }
+    }
+
+    void setMethod(Method method)
+    {
+        reset();
+        this->method = method;
+    }
+
+private:
+    struct CellRange
+    {
+        int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+
+        bool operator == (const CellRange &o) const noexcept
+        {
+            return x0 == o.x0 and y0 == o.y0 and x1 == o.x1 and y1 == o.y1;
+        }
+        bool operator != (const CellRange &o) const noexcept
+        {
+            return not (*this == o);
+        }
+        bool contains(int cx, int cy) const noexcept
+        {
+            return cx >= x0 and cx <= x1 and cy >= y0 and cy <= y1;
+        }
+    };
+
+    struct Proxy
+    {
+        EntityBase *entity = nullptr;
+        Rect bounds;
+        CellRange cells;
+        bool active = false;
+    };
+
+    using Cell = vector<uint32_t>;
+
+    void reset()
+    {
+        proxies.clear();
+        cells.clear();
+        order.clear();
+    }
+
+    static uint64_t key(int cx, int cy) noexcept
+    {
+        return (uint64_t(uint32_t(cx)) << 32) | uint32_t(cy);
+    }
+
+    int toCell(int v) const noexcept
+    {
+        // floor division, so negative coordinates land in the right cell
+        return v >= 0 ? v / cellSize : (v + 1) / cellSize - 1;
+    }
+
+    CellRange cellRange(const Rect &r) const noexcept
+    {
+        return CellRange{ toCell(r.x), toCell(r.y),
+                          toCell(r.right() - 1), toCell(r.bottom() - 1) };
+    }
+
+    void updateHash()
+    {
+        for (uint32_t i = 0; i < proxies.size(); i++) {
+            auto &p = proxies[i];
+            auto range = p.active ? cellRange(p.bounds) : CellRange{};
+            if (range == p.cells) {
+                continue;
+            }
+            for (int cx = p.cells.x0; cx <= p.cells.x1; cx++) {
+                for (int cy = p.cells.y0; cy <= p.cells.y1; cy++) {
+                    if (not range.contains(cx, cy)) {
+                        removeFromCell(key(cx, cy), i);
+                    }
+                }
+            }
+            for (int cx = range.x0; cx <= range.x1; cx++) {
+                for (int cy = range.y0; cy <= range.y1; cy++) {
+                    if (not p.cells.contains(cx, cy)) {
+                        cells[key(cx, cy)].push_back(i);
+                    }
+                }
+            }
+            p.cells = range;
+        }
+
+        for (auto &kv : cells) {
+            int cx = int32_t(kv.first >> 32), cy = int32_t(kv.first);
+            auto &cell = kv.second;
+            for (size_t i = 0; i < cell.size(); i++) {
+                auto &a = proxies[cell[i]];
+                for (size_t j = i + 1; j < cell.size(); j++) {
+                    auto &b = proxies[cell[j]];
+                    if (not a.bounds.intersects(b.bounds)) {
+                        continue;
+                    }
+                    // a pair sharing several cells is only reported from the
+                    // cell holding the top-left corner of the overlap
+                    int ox = std::max(a.bounds.x, b.bounds.x);
+                    int oy = std::max(a.bounds.y, b.bounds.y);
+                    if (toCell(ox) == cx and toCell(oy) == cy) {
+                        report(a, b);
+                    }
+                }
+            }
+        }
+    }
+
+    void removeFromCell(uint64_t k, uint32_t index)
+    {
+        auto it = cells.find(k);
+        if (it == cells.end()) {
+            return;
+        }
+        auto &cell = it->second;
+        auto pos = std::find(cell.begin(), cell.end(), index);
+        if (pos != cell.end()) {
+            *pos = cell.back();
+            cell.pop_back();
+        }
+        if (cell.empty()) {
+            cells.erase(it);
+        }
+    }
+
+    void sweepAndPrune()
+    {
+        auto left = [this](uint32_t i) { return proxies[i].bounds.x; };
+        if (order.size() < proxies.size()) {
+            while (order.size() < proxies.size()) {
+                order.push_back(order.size());
+            }
+            std::sort(order.begin(), order.end(),
+                      [&](uint32_t a, uint32_t b) { return left(a) < left(b); });
+        }
+        // insertion sort: the order barely changes between frames, which makes
+        // this close to linear
+        for (size_t i = 1; i < order.size(); i++) {
+            auto cur = order[i];
+            size_t j = i;
+            while (j > 0 and left(order[j - 1]) > left(cur)) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = cur;
+        }
+
+        for (size_t i = 0; i < order.size(); i++) {
+            auto &a = proxies[order[i]];
+            if (not a.active) {
+                continue;
+            }
+            for (size_t j = i + 1; j < order.size(); j++) {
+                auto &b = proxies[order[j]];
+                if (b.bounds.x >= a.bounds.right()) {
+                    break;
+                }
+                if (b.active and a.bounds.intersects(b.bounds)) {
+                    report(a, b);
+                }
+            }
+        }
+    }
+
+    static void report(Proxy &a, Proxy &b)
+    {
+        a.entity->onCollision(*b.entity);
+        b.entity->onCollision(*a.entity);
+    }
+
+private:
+    Method method;
+    int cellSize;
+    vector<Proxy> proxies;
+    std::unordered_map<uint64_t, Cell> cells;
+    vector<uint32_t> order;
+};
+
+/******************************************************************************/
+/* Animator                                                                   */
+
+enum class Easing { Linear, QuadIn, QuadOut, QuadInOut, CubicInOut, Count };
+
+struct Keyframe
+{
+    float time;     // seconds from the start of the track
+    float value;
+    Easing easing = Easing::Linear;     // from the previous keyframe to this one
+};
+
+// Drives entity properties along keyframed tracks. Only the current segment
+// of each track is active; active segments are kept as structures of arrays
+// bucketed by easing, so a frame is one straight loop per easing function over
+// all of them. Finished tracks drop out and an idle animator costs nothing.
+class Animator
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Starts a track; the property takes the first keyframe's value right away
+    void animate(EntityBase &entity, Property property, vector<Keyframe> keys,
+                 bool loop = false)
+    {
+        auto target = entity.getProperty(property);
+        if ((not target.value and not target.color and not target.fixed)
+                or keys.empty()) {
+            return;
+        }
+        uint32_t id;
+        if (freeTracks.empty()) {
+            id = tracks.size();
+            tracks.emplace_back();
+        } else {
+            id = freeTracks.back();
+            freeTracks.pop_back();
+        }
+        tracks[id] = Track{ target, move(keys), loop, 0 };
+        startSegment(id, now());
+    }
+
+    void tween(EntityBase &entity, Property property, float from, float to,
+               float seconds, Easing easing = Easing::Linear)
+    {
+        animate(entity, property, { { 0, from }, { seconds, to, easing } });
+    }
+
+    bool idle() const noexcept
+    {
+        return active == 0;
+    }
+
+    void update()
+    {
+        if (idle()) {
+            return;
+        }
+        const float t = now();
+        for (int e = 0; e < int(Easing::Count); e++) {
+            evaluate(buckets[e], Easing(e), t);
+        }
+        for (auto &f : finished) {
+            advance(f.first, f.second);
+        }
+        finished.clear();
+    }
+
+private:
+    struct Track
+    {
+        PropertyRef target;
+        vector<Keyframe> keys;
+        bool loop;
+        size_t segment;
+    };
+
+    // active segments sharing one easing function
+    struct Bucket
+    {
+        vector<float> start, invDuration, from, delta;
+        vector<float> value, progress;
+        vector<uint32_t> track;
+
+        size_t size() const noexcept
+        {
+            return track.size();
+        }
+
+        void add(uint32_t id, float s, float d, float a, float b)
+        {
+            start.push_back(s);
+            invDuration.push_back(d > 0 ? 1 / d : 1e30f);
+            from.push_back(a);
+            delta.push_back(b - a);
+            track.push_back(id);
+            value.push_back(a);
+            progress.push_back(0);
+        }
+
+        void remove(size_t i)
+        {
+            for (auto *v : { &start, &invDuration, &from, &delta, &value, &progress }) {
+                (*v)[i] = v->back();
+                v->pop_back();
+            }
+            track[i] = track.back();
+            track.pop_back();
+        }
+    };
+
+    float now() const
+    {
+        return std::chrono::duration<float>(Clock::now() - epoch).count();
+    }
+
+    void startSegment(uint32_t id, float at)
+    {
+        auto &track = tracks[id];
+        if (track.segment == 0) {
+            apply(track.target, track.keys[0].value);
+            track.segment = 1;
+        }
+        if (track.segment >= track.keys.size()) {
+            finish(id);
+            return;
+        }
+        auto &a = track.keys[track.segment - 1], &b = track.keys[track.segment];
+        buckets[int(b.easing)].add(id, at, b.time - a.time, a.value, b.value);
+        active++;
+    }
+
+    // Called when the current segment of a track is over; `at` is when it
+    // ended, so chained segments don't drift
+    void advance(uint32_t id, float at)
+    {
+        auto &track = tracks[id];
+        track.segment++;
+        if (track.segment >= track.keys.size() and track.loop) {
+            track.segment = 0;
+        }
+        startSegment(id, at);
+    }
+
+    void finish(uint32_t id)
+    {
+        tracks[id] = Track{};
+        freeTracks.push_back(id);
+    }
+
+    static void apply(const PropertyRef &target, float value)
+    {
+        if (target.value) {
+            *target.value = int(std::lround(value));
+        } else if (target.fixed) {
+            *target.fixed = Fixed(value);
+        } else {
+            *target.color = Color::makeSOG(unsigned(std::max(0L, std::lround(value))));
+        }
+    }
+
+    void evaluate(Bucket &b, Easing easing, float now)
+    {
+        const size_t n = b.size();
+        if (n == 0) {
+            return;
+        }
+        float *__restrict p = b.progress.data();
+        float *__restrict v = b.value.data();
+        const float *start = b.start.data(), *inv = b.invDuration.data();
+        const float *from = b.from.data(), *delta = b.delta.data();
+        for (size_t i = 0; i < n; i++) {
+            p[i] = std::min(std::max((now - start[i]) * inv[i], 0.0f), 1.0f);
+        }
+        switch (easing) {
+            case Easing::Linear:
+                for (size_t i = 0; i < n; i++) {
+                    v[i] = p[i];
+                }
+                break;
+            case Easing::QuadIn:
+                for (size_t i = 0; i < n; i++) {
+                    v[i] = p[i] * p[i];
+                }
+                break;
+            case Easing::QuadOut:
+                for (size_t i = 0; i < n; i++) {
+                    v[i] = p[i] * (2 - p[i]);
+                }
+                break;
+            case Easing::QuadInOut:
+                for (size_t i = 0; i < n; i++) {
+                    float q = 1 - p[i];
+                    v[i] = p[i] < 0.5f ? 2 * p[i] * p[i] : 1 - 2 * q * q;
+                }
+                break;
+            case Easing::CubicInOut:
+                for (size_t i = 0; i < n; i++) {
+                    float q = 1 - p[i];
+                    v[i] = p[i] < 0.5f ? 4 * p[i] * p[i] * p[i] : 1 - 4 * q * q * q;
+                }
+                break;
+            case Easing::Count:
+                break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            v[i] = from[i] + delta[i] * v[i];
+        }
+
+        // removal swaps the last segment in, which was evaluated already
+        for (size_t i = 0; i < b.size();) {
+            apply(tracks[b.track[i]].target, v[i]);
+            if (p[i] < 1.0f) {
+                i++;
+                continue;
+            }
+            finished.emplace_back(b.track[i], b.start[i] + 1 / b.invDuration[i]);
+            b.remove(i);
+            active--;
+        }
+    }
+
+private:
+    Clock::time_point epoch = Clock::now();
+    vector<Track> tracks;
+    vector<uint32_t> freeTracks;
+    std::array<Bucket, size_t(Easing::Count)> buckets;
+    vector<std::pair<uint32_t, float> > finished;
+    size_t active = 0;
+};
+
+/******************************************************************************/
+/* TimerWheel                                                                 */
+
+// Hierarchical timing wheel with millisecond ticks. Each level has 64 slots of
+// intrusive lists, a level covers 64 times the range of the one below it and
+// its timers cascade down as their slot comes up. Inserting and cancelling is
+// O(1) and idle timers cost nothing until their slot is reached.
+class TimerWheel
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void ()>;
+
+    // Generation in the high bits, so a stale id never cancels a reused slot
+    using TimerId = uint64_t;
+    static constexpr TimerId NoTimer = 0;
+
+    TimerWheel() : origin{Clock::now()}
+    {
+        std::fill(std::begin(heads), std::end(heads), Nil);
+    }
+
+    // Calls back after delay, then every period if it isn't zero
+    TimerId schedule(Clock::duration delay, Callback callback,
+                     Clock::duration period = Clock::duration::zero())
+    {
+        uint32_t index;
+        if (freeList != Nil) {
+            index = freeList;
+            freeList = timers[index].next;
+        } else {
+            index = timers.size();
+            timers.emplace_back();
+        }
+        auto &timer = timers[index];
+        timer.expires = toTicks(Clock::now() - origin + delay);
+        timer.period = toTicks(period);
+        timer.callback = move(callback);
+        timer.live = true;
+        insert(index);
+        count++;
+        return TimerId(timer.generation) << 32 | (index + 1);
+    }
+
+    void cancel(TimerId id)
+    {
+        uint32_t index = uint32_t(id) - 1;
+        if (id == NoTimer or index >= timers.size()) {
+            return;
+        }
+        auto &timer = timers[index];
+        if (not timer.live or timer.generation != uint32_t(id >> 32)) {
+            return;
+        }
+        if (timer.list != Nil) {
+            unlink(index);
+        }
+        release(index);
+    }
+
+    // Fires everything due up to the current time
+    void advance()
+    {
+        const uint64_t target = elapsed() + 1;
+        while (now < target) {
+            // skip straight over ticks with nothing to fire or cascade
+            now = std::min(target, nextTick());
+            if (now < target) {
+                tick();
+            }
+        }
+    }
+
+    // Earliest moment a timer may fire, Clock::time_point::max() if none
+    Clock::time_point nextDeadline() const
+    {
+        if (count == 0) {
+            return Clock::time_point::max();
+        }
+        return origin + std::chrono::milliseconds(nextTick());
+    }
+
+    size_t size() const noexcept
+    {
+        return count;
+    }
+
+private:
+    static constexpr uint32_t Nil = ~uint32_t(0);
+    static constexpr uint32_t SlotBits = 6;
+    static constexpr uint32_t Slots = 1 << SlotBits;
+    static constexpr uint32_t SlotMask = Slots - 1;
+    static constexpr uint32_t Levels = 4;
+    // the firing list holds the slot being run, so callbacks may cancel
+    static constexpr uint32_t Firing = Levels * Slots;
+
+    struct Timer
+    {
+        uint64_t expires = 0;
+        uint64_t period = 0;
+        Callback callback;
+        uint32_t prev = Nil, next = Nil;
+        uint32_t list = Nil;
+        uint32_t generation = 0;
+        bool live = false;
+    };
+
+    // Deadlines round up and the clock rounds down, so nothing fires early
+    static uint64_t toTicks(Clock::duration d)
+    {
+        using std::chrono::milliseconds;
+        auto ms = std::chrono::ceil<milliseconds>(d).count();
+        return ms > 0 ? ms : 0;
+    }
+
+    uint64_t elapsed() const
+    {
+        using std::chrono::milliseconds;
+        return std::chrono::floor<milliseconds>(Clock::now() - origin).count();
+    }
+
+    // First tick with a slot to fire or cascade; for the upper levels that is
+    // where the slot cascades, so it never comes later than the real expiry
+    uint64_t nextTick() const
+    {
+        uint64_t best = ~uint64_t(0);
+        for (uint32_t level = 0; level < Levels; level++) {
+            if (occupied[level] == 0) {
+                continue;
+            }
+            const uint32_t shift = level * SlotBits;
+            const uint32_t current = (now >> shift) & SlotMask;
+            // rotate so the current slot is bit 0, slots behind it come last
+            uint64_t bits = occupied[level] >> current
+                          | (current ? occupied[level] << (Slots - current) : 0);
+            if (level > 0 and (now & ((uint64_t(1) << shift) - 1))) {
+                // the current slot of an upper level was already cascaded,
+                // what is left there belongs to the next revolution
+                bits &= ~uint64_t(1);
+            }
+            const uint64_t ahead = bits ? __builtin_ctzll(bits) : Slots;
+            const uint64_t slotTick = ((now >> shift) + ahead) << shift;
+            best = std::min(best, std::max(slotTick, now));
+        }
+        return best;
+    }
+
+    void insert(uint32_t index)
+    {
+        auto &timer = timers[index];
+        uint64_t expires = std::max(timer.expires, now);
+        uint64_t delta = expires - now;
+        uint32_t level = 0;
+        while (level + 1 < Levels and delta >= uint64_t(1) << (SlotBits * (level + 1))) {
+            level++;
+        }
+        if (delta >= uint64_t(1) << (SlotBits * Levels)) {
+            // beyond the top level, park in its furthest slot and re-place
+            // when that cascades
+            expires = now + (uint64_t(1) << (SlotBits * Levels)) - 1;
+        }
+        uint32_t slot = (expires >> (level * SlotBits)) & SlotMask;
+        link(index, level * Slots + slot);
+    }
+
+    void link(uint32_t index, uint32_t list)
+    {
+        auto &timer = timers[index];
+        timer.list = list;
+        timer.prev = Nil;
+        timer.next = heads[list];
+        if (timer.next != Nil) {
+            timers[timer.next].prev = index;
+        }
+        heads[list] = index;
+        if (list < Firing) {
+            occupied[list / Slots] |= uint64_t(1) << (list % Slots);
+        }
+    }
+
+    void unlink(uint32_t index)
+    {
+        auto &timer = timers[index];
+        if (timer.prev != Nil) {
+            timers[timer.prev].next = timer.next;
+        } else {
+            heads[timer.list] = timer.next;
+            if (timer.next == Nil and timer.list < Firing) {
+                occupied[timer.list / Slots] &= ~(uint64_t(1) << (timer.list % Slots));
+            }
+        }
+        if (timer.next != Nil) {
+            timers[timer.next].prev = timer.prev;
+        }
+        timer.list = Nil;
+    }
+
+    void release(uint32_t index)
+    {
+        auto &timer = timers[index];
+        timer.live = false;
+        timer.generation++;
+        timer.callback = nullptr;
+        timer.next = freeList;
+        freeList = index;
+        count--;
+    }
+
+    // moves a whole slot onto the firing list
+    void take(uint32_t list)
+    {
+        while (heads[list] != Nil) {
+            uint32_t index = heads[list];
+            unlink(index);
+            link(index, Firing);
+        }
+    }
+
+    void tick()
+    {
+        const uint64_t t = now;
+        for (uint32_t level = 1; level < Levels; level++) {
+            if ((t >> (SlotBits * (level - 1))) & SlotMask) {
+                break;
+            }
+            uint32_t list = level * Slots + ((t >> (SlotBits * level)) & SlotMask);
+            take(list);
+            while (heads[Firing] != Nil) {
+                uint32_t index = heads[Firing];
+                unlink(index);
+                insert(index);
+            }
+        }
+        take(t & SlotMask);
+        now = t + 1;
+        while (heads[Firing] != Nil) {
+            uint32_t index = heads[Firing];
+            unlink(index);
+            if (timers[index].expires > t) {
+                // parked beyond the wheel's range, not due yet
+                insert(index);
+                continue;
+            }
+            // held outside the timer while it runs, it may cancel itself
+            auto callback = move(timers[index].callback);
+            const uint32_t generation = timers[index].generation;
+            callback();
+            auto &timer = timers[index];
+            if (timer.generation != generation) {
+                continue;   // cancelled itself
+            }
+            timer.callback = move(callback);
+            if (timer.period != 0) {
+                timer.expires = t + timer.period;
+                insert(index);
+            } else {
+                release(index);
+            }
+        }
+    }
+
+    const Clock::time_point origin;
+    uint64_t now = 0;   // next tick to process
+    std::deque<Timer> timers;
+    uint32_t freeList = Nil;
+    size_t count = 0;
+    uint32_t heads[Levels * Slots + 1];
+    uint64_t occupied[Levels] = {};
+};
+
+/******************************************************************************/
+/* FrameBudget                                                                */
+
+// Keeps frames within a time budget. Optional work is registered with a
+// priority; while recent frames run over budget, the lowest priority entity is
+// stepped down a quality level, and once it has none left its updates are
+// deferred to every 2nd, 4th and then 8th frame. Quality comes back, highest
+// priority first, when frames are comfortably under budget again.
+class FrameBudget
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit FrameBudget(Clock::duration budget = 12ms) : budget{budget} {}
+
+    void setBudget(Clock::duration budget)
+    {
+        this->budget = budget;
+    }
+
+    // Higher priorities are degraded last
+    void add(EntityBase &entity, int priority)
+    {
+        Item item{&entity, priority, 0, entity.qualityLevels() + MaxDefer};
+        auto pos = std::upper_bound(items.begin(), items.end(), item,
+                [](auto &a, auto &b) { return a.priority < b.priority; });
+        items.insert(pos, item);
+    }
+
+    // Whether the entity updates this frame
+    bool due(const EntityBase *entity) const
+    {
+        if (deferred == 0) {
+            return true;
+        }
+        for (unsigned i = 0; i < items.size(); i++) {
+            auto &item = items[i];
+            if (item.entity == entity) {
+                auto defer = item.level - (item.levels - MaxDefer - 1);
+                // staggered, so deferred entities don't all land on one frame
+                return defer <= 0 or (frame + i) % (1u << defer) == 0;
+            }
+        }
+        return true;
+    }
+
+    // Called with how long the last frame took to update, draw and present
+    void frameDone(Clock::duration spent)
+    {
+        frame++;
+        // exponential moving average over roughly the last 8 frames
+        average += (spent - average) / 8;
+        if (cooldown > 0) {
+            cooldown--;
+            return;
+        }
+        if (average > budget) {
+            degrade();
+        } else if (average < budget / 2) {
+            improve();
+        }
+    }
+
+    Clock::duration getAverage() const noexcept
+    {
+        return average;
+    }
+
+private:
+    static constexpr int MaxDefer = 3;
+    // frames to let the average settle after a change
+    static constexpr int Settle = 8;
+
+    struct Item
+    {
+        EntityBase *entity;
+        int priority;
+        int level;
+        int levels;
+    };
+
+    void degrade()
+    {
+        for (auto &item : items) {
+            if (item.level + 1 < item.levels) {
+                setLevel(item, item.level + 1);
+                return;
+            }
+        }
+    }
+
+    void improve()
+    {
+        for (auto it = items.rbegin(); it != items.rend(); ++it) {
+            if (it->level > 0) {
+                setLevel(*it, it->level - 1);
+                return;
+            }
+        }
+    }
+
+    void setLevel(Item &item, int level)
+    {
+        const int qualities = item.levels - MaxDefer;
+        deferred -= item.level >= qualities;
+        deferred += level >= qualities;
+        item.level = level;
+        item.entity->setQuality(std::min(level, qualities - 1));
+        cooldown = Settle;
+    }
+
+    Clock::duration budget;
+    Clock::duration average{};
+    vector<Item> items;
+    unsigned frame = 0;
+    int deferred = 0;
+    int cooldown = 0;
+};
+
+/******************************************************************************/
+/* Behaviors                                                                  */
+
+// A coroutine driving an entity, e.g.
+//
+//     Behavior blink() { for (;;) { flip(); co_await sleep(500ms); } }
+//
+// Behaviors are started on a BehaviorScheduler and only run when what they
+// wait for comes due: the next frame, a deadline or a key press.
+class Behavior
+{
+public:
+    struct promise_type
+    {
+        Behavior get_return_object()
+        {
+            return Behavior{Handle::from_promise(*this)};
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        unsigned key = 0;   // the key that resumed a key() wait
+    };
+    using Handle = std::coroutine_handle<promise_type>;
+
+    Behavior(Behavior &&o) noexcept : handle{o.handle} { o.handle = {}; }
+    Behavior &operator = (Behavior &&o) noexcept
+    {
+        std::swap(handle, o.handle);
+        return *this;
+    }
+    ~Behavior()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    Handle getHandle() const noexcept
+    {
+        return handle;
+    }
+
+private:
+    explicit Behavior(Handle handle) : handle{handle} {}
+
+    Handle handle;
+};
+
+class BehaviorScheduler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+    using Handle = Behavior::Handle;
+
+    // Sleeping behaviors wait on the timers, which must be advanced before
+    // each update
+    explicit BehaviorScheduler(TimerWheel &timers) : timers{timers} {}
+
+    // Whether anything is waiting for the next frame
+    bool busy() const noexcept
+    {
+        return not frameWaiters.empty() or not pressed.empty();
+    }
+
+    // The scheduler resuming the current behavior, awaitables register with it
+    static BehaviorScheduler *&current()
+    {
+        static BehaviorScheduler *scheduler = nullptr;
+        return scheduler;
+    }
+
+    // Takes ownership, the behavior first runs on the next update
+    void start(Behavior behavior)
+    {
+        auto handle = behavior.getHandle();
+        owned.emplace(handle.address(), move(behavior));
+        waitFrame(handle);
+    }
+
+    void keyPressed(unsigned key)
+    {
+        pressed.push_back(key);
+    }
+
+    void update()
+    {
+        due.swap(frameWaiters);
+        for (auto key : pressed) {
+            for (size_t i = 0; i < keyWaiters.size();) {
+                auto &w = keyWaiters[i];
+                if (w.key == 0 or w.key == key) {
+                    w.handle.promise().key = key;
+                    due.push_back(w.handle);
+                    w = keyWaiters.back();
+                    keyWaiters.pop_back();
+                } else {
+                    i++;
+                }
+            }
+        }
+        pressed.clear();
+
+        auto *previous = current();
+        current() = this;
+        for (auto handle : due) {
+            handle.resume();
+            if (handle.done()) {
+                owned.erase(handle.address());
+            }
+        }
+        current() = previous;
+        due.clear();
+    }
+
+    void waitFrame(Handle handle)
+    {
+        frameWaiters.push_back(handle);
+    }
+
+    void waitUntil(Handle handle, Clock::time_point deadline)
+    {
+        timers.schedule(deadline - Clock::now(), [this, handle] {
+            waitFrame(handle);
+        });
+    }
+
+    void waitKey(Handle handle, unsigned key)
+    {
+        keyWaiters.push_back(KeyWaiter{key, handle});
+    }
+
+private:
+    struct KeyWaiter
+    {
+        unsigned key;
+        Handle handle;
+    };
+
+    std::unordered_map<void *, Behavior> owned;
+    vector<Handle> frameWaiters;
+    vector<Handle> due;
+    TimerWheel &timers;
+    vector<KeyWaiter> keyWaiters;
+    vector<unsigned> pressed;
+};
+
+// co_await nextFrame() resumes on the next update
+inline auto nextFrame()
+{
+    struct Awaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(Behavior::Handle h) { BehaviorScheduler::current()->waitFrame(h); }
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{};
+}
+
+// co_await sleep(500ms) resumes on the first update after the delay
+inline auto sleep(std::chrono::steady_clock::duration delay)
+{
+    struct Awaiter
+    {
+        std::chrono::steady_clock::time_point deadline;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(Behavior::Handle h)
+        {
+            BehaviorScheduler::current()->waitUntil(h, deadline);
+        }
+        void await_resume() const noexcept {}
+    };
+    return Awaiter{std::chrono::steady_clock::now() + delay};
+}
+
+// co_await key('w') resumes when 'w' is pressed, key() on any key; the
+// result is the key that was pressed
+inline auto key(unsigned k = 0)
+{
+    struct Awaiter
+    {
+        unsigned k;
+        Behavior::Handle handle;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(Behavior::Handle h)
+        {
+            handle = h;
+            BehaviorScheduler::current()->waitKey(h, k);
+        }
+        unsigned await_resume() const noexcept { return handle.promise().key; }
+    };
+    return Awaiter{k};
+}
+
+/******************************************************************************/
+/* Screen                                                                     */
+
+class Screen
+{
+public:
+    Screen(uptr<Display> &&display) : entities{}, display{move(display)} {}
+    void resize(size_t width, size_t height)
+    {
+        display->resize(width, height);
+        damage.addAll();
+    }
+
+    void update()
+    {
+        timers.advance();
+        animator.update();
+        behaviors.update();
+        for (auto *e : updating) {
+            if (budget.due(e)) {
+                e->update();
+            }
+        }
+        collisions.update(entities);
+        for (auto &e : entities) {
+            e->collectDamage(damage);
+        }
+    }
+
+    void drawSize()
+    {
+        auto sizeText = concat(tb_width(), 'x', tb_height());
+        Text t{0, 0, sizeText, Color::White, Color::Black};
+        t.drawStraightToTermbox();
+    }
+
+    void draw()
+    {
+        if (not damage.empty()) {
+            display->clear(damage);
+            for (auto &e : entities) {
+                e->draw(*display);
+            }
+            display->display(damage);
+            damage.clear();
+        }
+        drawSize();
+    }
+
+    void addEntity(uptr<Entities::Entity> &&entity)
+    {
+        if (entity->wantsUpdate()) {
+            updating.push_back(entity.get());
+        }
+        if (entity->wantsMouse()) {
+            mouseTargets.push_back(entity.get());
+        }
+        entities.add(move(entity));
+        damage.addAll();
+    }
+
+    void keyPressed(unsigned key)
+    {
+        behaviors.keyPressed(key);
+    }
+
+    void mouseEvent(const MouseEvent &event)
+    {
+        for (auto *e : mouseTargets) {
+            e->onMouse(event);
+        }
+    }
+
+    // Saves what is on the display, encoded in the background
+    bool screenshot(string path)
+    {
+        Snapshot shot;
+        if (not display->snapshot(shot)) {
+            return false;
+        }
+        screenshotWriter().save(move(shot), move(path));
+        return true;
+    }
+
+    // Everything gets redrawn, e.g. after the output mode changed
+    void invalidate()
+    {
+        damage.addAll();
+    }
+
+    // Whether the next frame has work regardless of timers and input
+    bool busy() const noexcept
+    {
+        return not updating.empty() or not animator.idle() or behaviors.busy()
+            or not damage.empty();
+    }
+
+    TimerWheel::Clock::time_point nextDeadline() const
+    {
+        return timers.nextDeadline();
+    }
+
+    void setDisplay(uptr<Display> &&display)
+    {
+        this->display = move(display);
+    }
+
+    CollisionSystem &getCollisions() noexcept
+    {
+        return collisions;
+    }
+
+    Animator &getAnimator() noexcept
+    {
+        return animator;
+    }
+
+    BehaviorScheduler &getBehaviors() noexcept
+    {
+        return behaviors;
+    }
+
+    TimerWheel &getTimers() noexcept
+    {
+        return timers;
+    }
+
+    FrameBudget &getBudget() noexcept
+    {
+        return budget;
+    }
+
+private:
+    Entities entities;
+    vector<Entities::Entity *> updating;
+    vector<Entities::Entity *> mouseTargets;
+    TimerWheel timers;
+    BehaviorScheduler behaviors{timers};
+    FrameBudget budget;
+    CollisionSystem collisions;
+    Animator animator;
+    Damage damage;
+    uptr<Display> display;
+};
+
+/******************************************************************************/
+/* TerminalProbe                                                              */
+
+// Writes all of data, carrying on after short writes and signals
+inline bool writeAll(int fd, const char *data, size_t size)
+{
+    for (size_t sent = 0; sent < size;) {
+        auto n = write(fd, data + sent, size - sent);
+        if (n < 0 and errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// What the startup probe found out about the terminal, cached per $TERM
+struct TerminalProfile
+{
+    OutputMode colors = OutputMode::Colors256;
+    GlyphMode glyphs = GlyphMode::HalfBlocks;
+    bool truecolor = false;
+    bool synchronizedOutput = false;
+    int frameRate = 60;
+    double throughput = 0;  // bytes per second the terminal took in
+
+    static string cachePath()
+    {
+        auto home = getenv("HOME");
+        return home ? concat(home, "/.cache/termbox-test.probe") : string{};
+    }
+
+    static bool load(const string &term, TerminalProfile &profile)
+    {
+        std::ifstream in{cachePath()};
+        string line;
+        while (std::getline(in, line)) {
+            std::istringstream fields{line};
+            string name;
+            int colors, glyphs;
+            TerminalProfile p;
+            // anything out of range is a stale or broken line, probe again
+            if (fields >> name >> colors >> glyphs >> p.truecolor
+                    >> p.synchronizedOutput >> p.frameRate >> p.throughput
+                    and name == term
+                    and colors >= 0 and colors < int(OutputMode::Count)
+                    and (glyphs == int(GlyphMode::HalfBlocks) or glyphs == int(GlyphMode::Cells))
+                    and p.frameRate > 0) {
+                p.colors = OutputMode(colors);
+                p.glyphs = GlyphMode(glyphs);
+                profile = p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void save(const string &term) const
+    {
+        auto path = cachePath();
+        if (path.empty()) {
+            return;
+        }
+        // keep the other terminals' lines
+        std::ifstream in{path};
+        stringstream kept;
+        string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, term.size() + 1, term + ' ') != 0) {
+                kept << line << '\n';
+            }
+        }
+        in.close();
+        std::ofstream out{path, std::ios::trunc};
+        out << kept.str() << term << ' ' << int(colors) << ' ' << int(glyphs) << ' '
+            << truecolor << ' ' << synchronizedOutput << ' ' << frameRate << ' '
+            << throughput << '\n';
+    }
+};
+
+// Asks the terminal about itself before termbox takes over the tty, inside
+// the alternate screen so nothing is left behind:
+//   - glyph widths, by printing a half block and reading the cursor back,
+//   - synchronized output (mode 2026) through DECRQM,
+//   - throughput, timing a burst of colored cells until the terminal answers
+//     a cursor position request queued behind it.
+// Primary device attributes, which every terminal answers, end each phase.
+// Everything has to be done within Budget.
+class TerminalProbe
+{
+public:
+    static constexpr auto Budget = 45ms;
+
+    // False if the terminal never answered; profile then only has what
+    // $TERM and $COLORTERM suggest
+    static bool run(TerminalProfile &profile)
+    {
+        TerminalProbe probe;
+        return probe.probe(profile);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    bool probe(TerminalProfile &profile)
+    {
+        profile = TerminalProfile{};
+        auto term = getenv("TERM");
+        auto colorterm = getenv("COLORTERM");
+        string name = term ? term : "";
+        profile.truecolor = colorterm and (string{colorterm} == "truecolor"
+                                           or string{colorterm} == "24bit");
+        // consoles known for 8 colors and no block glyphs, anything else is
+        // assumed to be a 256 color emulator
+        if (name == "linux" or name == "vt100" or name == "vt220" or name == "dumb") {
+            profile.colors = OutputMode::Colors8;
+            profile.glyphs = GlyphMode::Cells;
+        }
+
+        fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        termios saved;
+        if (tcgetattr(fd, &saved) != 0) {
+            close(fd);
+            return false;
+        }
+        winsize size;
+        if (ioctl(fd, TIOCGWINSZ, &size) == 0 and size.ws_col > 0) {
+            cells = size.ws_col * size.ws_row;
+        }
+        auto raw = saved;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(fd, TCSANOW, &raw);
+        deadline = Clock::now() + Budget;
+
+        send("\033[?1049h\033[H\r" "▄" "\033[6n" "\033[?2026$p" "\033[c");
+        bool answered = awaitAttributes();
+        if (answered) {
+            auto col = cursorColumn(0);
+            if (col != 0 and col != 2) {
+                profile.glyphs = GlyphMode::Cells;
+            }
+            auto sync = replies.find("\033[?2026;");
+            if (sync != string::npos and sync + 8 < replies.size()) {
+                char state = replies[sync + 8];
+                profile.synchronizedOutput = state == '1' or state == '2';
+            }
+
+            // a frame's worth of 256 color half blocks
+            string burst = "\033[H";
+            while (burst.size() < BurstSize) {
+                burst += concat("\033[38;5;", 16 + burst.size() % 216, "m\033[48;5;",
+                                232 + burst.size() % 24, "m▄");
+            }
+            replies.clear();
+            auto start = Clock::now();
+            send(burst + "\033[6n\033[c");
+            if (awaitAttributes()) {
+                auto spent = std::chrono::duration<double>(Clock::now() - start).count();
+                profile.throughput = burst.size() / std::max(spent, 1e-4);
+            } else {
+                // didn't finish in time, that's a lower bound at most
+                profile.throughput = burst.size() / std::chrono::duration<double>(Budget).count();
+            }
+            profile.frameRate = pickFrameRate(profile);
+            if (profile.frameRate < MinFrameRate and profile.colors != OutputMode::Colors8) {
+                // short 8 color escape codes keep the frame rate up on slow links
+                profile.colors = OutputMode::Colors8;
+                profile.frameRate = pickFrameRate(profile);
+            }
+        }
+        send("\033[?1049l");
+        // answers that came in late must not reach termbox as key presses
+        tcflush(fd, TCIFLUSH);
+        tcsetattr(fd, TCSANOW, &saved);
+        close(fd);
+        return answered;
+    }
+
+    void send(const string &data)
+    {
+        writeAll(fd, data.data(), data.size());
+    }
+
+    // reads replies until the device attributes answer "ESC [ ? ... c" arrives
+    bool awaitAttributes()
+    {
+        char buffer[256];
+        for (;;) {
+            auto da = replies.find("\033[?");
+            while (da != string::npos) {
+                auto end = replies.find_first_not_of("0123456789;", da + 3);
+                if (end != string::npos and replies[end] == 'c') {
+                    return true;
+                }
+                da = replies.find("\033[?", da + 3);
+            }
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - Clock::now()).count();
+            if (left <= 0) {
+                return false;
+            }
+            pollfd p{fd, POLLIN, 0};
+            if (poll(&p, 1, int(left)) <= 0) {
+                return false;
+            }
+            auto n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                return false;
+            }
+            replies.append(buffer, n);
+        }
+    }
+
+    // column of the nth cursor position report "ESC [ row ; col R", 0 if none
+    int cursorColumn(int nth) const
+    {
+        size_t pos = 0;
+        while ((pos = replies.find("\033[", pos)) != string::npos) {
+            auto end = replies.find_first_not_of("0123456789;", pos + 2);
+            if (end == string::npos) {
+                break;
+            }
+            auto semicolon = replies.find(';', pos + 2);
+            if (replies[end] == 'R' and semicolon < end and nth-- == 0) {
+                return std::atoi(replies.c_str() + semicolon + 1);
+            }
+            pos = end;
+        }
+        return 0;
+    }
+
+    // how often the whole screen could be sent, counting the long escape codes
+    // of the 256 color modes and the short ones of 8 colors
+    int pickFrameRate(const TerminalProfile &profile) const
+    {
+        const double bytesPerCell = profile.colors == OutputMode::Colors8 ? 10 : 24;
+        auto fps = profile.throughput / (cells * bytesPerCell);
+        return int(std::clamp(fps, 10.0, 60.0));
+    }
+
+    static constexpr size_t BurstSize = 16 * 1024;
+    static constexpr int MinFrameRate = 20;
+
+    int cells = 80 * 24;
+
+    int fd = -1;
+    Clock::time_point deadline;
+    string replies;
+};
+
+/******************************************************************************/
+/* Termbox                                                                    */
+
+class Termbox
+{
+public:
+    bool init()
+    {
+        // the probe needs the tty to itself, so it runs before termbox starts
+        auto term = getenv("TERM");
+        string name = term ? term : "";
+        if (not TerminalProfile::load(name, profile)) {
+            auto start = std::chrono::steady_clock::now();
+            // a terminal that didn't answer may just have been slow this time
+            if (TerminalProbe::run(profile)) {
+                profile.save(name);
+            }
+            log("probe: ", std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count(), "ms, ",
+                int(profile.throughput / 1024), " KiB/s", endl);
+        }
+        if (auto res = tb_init()) {
+            cerr << "tb_init() failed with error code " << res << endl;
+            return false;
+        }
+        tb_select_input_mode(TB_INPUT_ALT | TB_INPUT_MOUSE);
+        colorOutput().select(profile.colors);
+        colorOutput().setGlyphs(profile.glyphs);
+        frameRate = profile.frameRate;
+        if (profile.synchronizedOutput) {
+            syncFd = open("/dev/tty", O_WRONLY | O_CLOEXEC);
+        }
+        if (auto colors = getenv("TB_COLORS")) {
+            string name = colors;
+            colorOutput().select(name == "8" ? OutputMode::Colors8
+                               : name == "216" ? OutputMode::Cube216
+                               : name == "gray" ? OutputMode::Grayscale
+                               : OutputMode::Colors256);
+        }
+        applyOutputMode();
+        return true;
+    }
+
+    // F2 cycles through the output modes
+    void cycleOutputMode()
+    {
+        auto &out = colorOutput();
+        out.select(OutputMode((int(out.getMode()) + 1) % int(OutputMode::Count)));
+        applyOutputMode();
+        if (screen) {
+            screen->invalidate();
+        }
+    }
+
+    void applyOutputMode()
+    {
+        auto &out = colorOutput();
+        tb_select_output_mode(out.termboxMode());
+        tb_set_clear_attributes(out.fg(Color::White), out.bg(Color::Black));
+    }
+
+    // Presents the frame, within a synchronized update if the terminal has them
+    // so it never shows a half drawn frame
+    void present()
+    {
+        if (syncFd >= 0 and not writeAll(syncFd, "\033[?2026h", 8)) {
+            stopSynchronizing();
+        }
+        tb_present();
+        if (syncFd >= 0 and not writeAll(syncFd, "\033[?2026l", 8)) {
+            stopSynchronizing();
+        }
+    }
+
+    // The tty went away or refuses writes, frames go out unsynchronized
+    void stopSynchronizing()
+    {
+        log("synchronized output failed: ", strerror(errno), endl);
+        close(syncFd);
+        syncFd = -1;
+    }
+
+    ~Termbox()
+    {
+        if (syncFd >= 0) {
+            close(syncFd);
+        }
+        tb_shutdown();
         cout << "LOGs:" << endl << logStream.str() << endl;
     }
 
-    void processKey()
+    void processKey()
+    {
+        for (auto &key : quitKeys) {
+            if (currEvent.key == key or currEvent.ch == key) {
+                running = false;
+            }
+        }
+        if (currEvent.key == TB_KEY_F2) {
+            cycleOutputMode();
+        }
+        if (currEvent.key == TB_KEY_F12) {
+            auto path = concat("screenshot-", screenshots++, ".png");
+            if (screen->screenshot(path)) {
+                log("saved ", path, endl);
+            }
+        }
+        screen->keyPressed(currEvent.key != 0 ? currEvent.key : currEvent.ch);
+    }
+    void processResize() {}
+    void processMouse()
+    {
+        // cells are two pixels high, the upper one stands for the cell
+        screen->mouseEvent(MouseEvent{currEvent.x, currEvent.y * 2, currEvent.key});
+    }
+    unsigned getCurrentKey() const
+    {
+        bool wrote = false;
+        if (currEvent.key != 0) {
+            log("key: ", currEvent.key);
+            wrote = true;
+        } if (currEvent.ch != 0) {
+            log(wrote ? " " : "", "ch: '", char(currEvent.ch), "'");
+            wrote = true;
+        } if (wrote) {
+            log(endl);
+        }
+        return currEvent.key != 0 ? currEvent.key : currEvent.ch;
+    }
+
+    void dispatch()
+    {
+        switch (currEvent.type) {
+            case TB_EVENT_KEY:
+                processKey();
+                break;
+            case TB_EVENT_RESIZE:
+                processResize();
+                break;
+            case TB_EVENT_MOUSE:
+                processMouse();
+                break;
+        }
+    }
+
+    void loop()
+    {
+        using Clock = TimerWheel::Clock;
+        const auto frameTime = std::chrono::microseconds(1000000 / frameRate);
+
+        screen->getBudget().setBudget(frameTime * 3 / 4);
+        tb_clear();
+        screen->draw();
+        present();
+        auto nextFrame = Clock::now() + frameTime;
+        while (running) {
+            // a busy screen wants every frame, an idle one only wakes for
+            // input or its nearest timer
+            auto wake = screen->busy() ? nextFrame : screen->nextDeadline();
+            int event;
+            if (wake == Clock::time_point::max()) {
+                event = tb_poll_event(&currEvent);
+            } else {
+                auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - Clock::now());
+                event = tb_peek_event(&currEvent, std::max<int>(0, wait.count()));
+            }
+            if (event > 0) {
+                dispatch();
+                // a mouse drag reports far more often than frames are drawn,
+                // so everything already queued goes into this frame
+                for (int n = 1; currEvent.type == TB_EVENT_MOUSE and n < MaxCoalesced
+                                and tb_peek_event(&currEvent, 0) > 0; n++) {
+                    dispatch();
+                }
+            }
+            auto start = Clock::now();
+            screen->update();
+            screen->draw();
+            present();
+            auto now = Clock::now();
+            screen->getBudget().frameDone(now - start);
+            nextFrame = std::max(nextFrame + frameTime, now);
+        }
+    }
+
+    void setScreen(uptr<Screen> screen)
+    {
+        this->screen = move(screen);
+        this->screen->resize(getWidth(), getHeight());
+    }
+
+    size_t getWidth() const noexcept
+    {
+        return tb_width();
+    }
+
+    size_t getHeight() const noexcept
+    {
+        return tb_height();
+    }
+
+    void log() const {}
+    template <typename T, typename... Rest>
+    void log(T &&val, Rest &&...rest) const
+    {
+        logStream << forward<T>(val);
+        log(forward<Rest>(rest)...);
+    }
+
+    using Key = unsigned;
+    using Keys = vector<Key>;
+
+private:
+    // bounds the time spent draining input before a frame
+    static constexpr int MaxCoalesced = 256;
+
+    uptr<Screen> screen;
+    int frameRate = 60;
+    TerminalProfile profile;
+    int syncFd = -1;
+    int screenshots = 0;
+    tb_event currEvent;
+    Keys quitKeys = { 'q', TB_KEY_CTRL_C };
+    bool running = true;
+    mutable stringstream logStream;
+};
+
+uptr<Termbox> tb;
+
+/******************************************************************************/
+/* Circle                                                                      */
+
+class Circle : public IntEntity
+{
+public:
+    Circle(int x, int y, int radius, Color color)
+        : IntEntity{x, y}, radius{radius}, color{color} {}
+
+    virtual void update() override {}
+    virtual void draw(Display &display) const override
+    {
+        if (radius != drawnRadius or color != drawnColor or not bitmap) {
+            bitmap = getBitmap(radius, color);
+            drawnRadius = radius;
+        }
+        bitmap->draw(display, x - radius, y - radius);
+        getBounds(drawnBounds);
+        drawnColor = color;
+    }
+    bool getBounds(Rect &bounds) const override
+    {
+        bounds = Rect{x - radius, y - radius, 2 * radius + 1, 2 * radius + 1};
+        return true;
+    }
+    void collectDamage(Damage &damage) override
+    {
+        Rect bounds;
+        getBounds(bounds);
+        if (bounds != drawnBounds or color != drawnColor) {
+            damage.add(drawnBounds);
+            damage.add(bounds);
+        }
+    }
+    PropertyRef getProperty(Property property) override
+    {
+        switch (property) {
+            case Property::Radius:
+                return PropertyRef{&radius};
+            case Property::Gray:
+                return PropertyRef{nullptr, &color};
+            default:
+                return IntEntity::getProperty(property);
+        }
+    }
+
+    // Draws a circle centered on (x, y) from the shared bitmaps, for circles
+    // that aren't entities of their own
+    static void drawShared(Display &display, int x, int y, int radius, Color color)
+    {
+        getBitmap(radius, color)->draw(display, x - radius, y - radius);
+    }
+
+protected:
+    int radius;
+    Color color = Color::White;
+
+private:
+    using BitmapPtr = std::shared_ptr<const Bitmap>;
+    static constexpr size_t MaxCachedBitmaps = 256;
+
+    // circles of the same radius and color share one bitmap; circles keep
+    // theirs alive, so a full cache can simply start over
+    static BitmapPtr getBitmap(int radius, Color color)
+    {
+        static std::map<std::pair<int, uint16_t>, BitmapPtr> cache;
+        auto found = cache.find({ radius, color });
+        if (found != cache.end()) {
+            return found->second;
+        }
+        if (cache.size() == MaxCachedBitmaps) {
+            cache.clear();
+        }
+        auto bitmap = std::make_shared<Bitmap>(Bitmap::circle(radius, color));
+        cache[{ radius, color }] = bitmap;
+        return bitmap;
+    }
+
+    // what the last draw() put on the display
+    mutable Rect drawnBounds;
+    mutable Color drawnColor = Color::Default;
+    mutable int drawnRadius = 0;
+    mutable BitmapPtr bitmap;
+};
+
+class MyCircle : public Circle
+{
+public:
+    using Circle::Circle;
+    virtual void update() override
+    {
+        switch (tb->getCurrentKey()) {
+            case '+':
+                radius++;
+                break;
+            case '-':
+                radius--;
+                break;
+            case 'w':
+                y--;
+                break;
+            case 's':
+                y++;
+                break;
+            case 'd':
+                x++;
+                break;
+            case 'a':
+                x--;
+                break;
+            default:
+                break;
+        }
+    }
+};
+
+class BouncingCircle : public Circle
+{
+public:
+    BouncingCircle(int x, int y, int radius, int dx, int dy, Rect world)
+        : Circle{x, y, radius, Idle}, dx{dx}, dy{dy}, world{world} {}
+
+    void update() override
+    {
+        if (x + dx < world.x or x + dx >= world.right()) {
+            dx = -dx;
+        }
+        if (y + dy < world.y or y + dy >= world.bottom()) {
+            dy = -dy;
+        }
+        x += dx;
+        y += dy;
+        color = Idle;
+    }
+
+    void onCollision(EntityBase &) override
+    {
+        color = Hit;
+    }
+
+private:
+    static constexpr Color Idle = Color{0, 128, 255};
+    static constexpr Color Hit = Color{255, 64, 0};
+
+    int dx, dy;
+    Rect world;
+};
+
+/******************************************************************************/
+/* SmoothCircle                                                               */
+
+// Circle at a subpixel position, so slow motion doesn't snap from pixel to
+// pixel. Rows are sampled SubRows times and the span ends give the exact
+// horizontal coverage of edge pixels, all in fixed point. Edge pixels are
+// blended over the cleared background, never over what the display holds:
+// outside its own damage that is the circle's last frame, and blending over
+// it again would darken the edges towards the solid color.
+class SmoothCircle : public FixedEntity
+{
+public:
+    static constexpr int SubRows = 4;
+
+    SmoothCircle(Fixed x, Fixed y, Fixed radius, Color color,
+                 Fixed dx = 0, Fixed dy = 0, Rect world = {})
+        : FixedEntity{x, y}, radius{radius}, color{color}, dx{dx}, dy{dy},
+          world{world} {}
+
+    void setAntialiased(bool on)
+    {
+        antialiasing = on;
+    }
+
+    bool wantsUpdate() const override
+    {
+        return dx != 0 or dy != 0;
+    }
+
+    void update() override
+    {
+        if (x + dx - radius < world.x or x + dx + radius > world.right()) {
+            dx = -dx;
+        }
+        if (y + dy - radius < world.y or y + dy + radius > world.bottom()) {
+            dy = -dy;
+        }
+        x += dx;
+        y += dy;
+    }
+
+    // coverage AA is the first thing to go under load
+    int qualityLevels() const override
+    {
+        return 2;
+    }
+
+    void setQuality(int level) override
+    {
+        degraded = level > 0;
+    }
+
+    bool getBounds(Rect &bounds) const override
+    {
+        int left = (x - radius).floor(), top = (y - radius).floor();
+        bounds = Rect{left, top, (x + radius).ceil() - left, (y + radius).ceil() - top};
+        return true;
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        if (x != drawnX or y != drawnY or color != drawnColor
+                or antialiased() != drawnAntialiased) {
+            Rect bounds;
+            getBounds(bounds);
+            damage.add(drawnBounds);
+            damage.add(bounds);
+        }
+    }
+
+    void draw(Display &display) const override
+    {
+        getBounds(drawnBounds);
+        drawnX = x;
+        drawnY = y;
+        drawnColor = color;
+        drawnAntialiased = antialiased();
+
+        auto area = drawnBounds.intersected(display.getClip());
+        if (area.empty()) {
+            return;
+        }
+        const int samples = antialiased() ? SubRows : 1;
+        const int32_t full = Fixed::One * samples;
+        const Fixed r2 = radius * radius;
+        coverage.resize(area.w);
+        for (int py = area.y; py < area.bottom(); py++) {
+            std::fill(coverage.begin(), coverage.end(), 0);
+            for (int k = 0; k < samples; k++) {
+                auto sy = Fixed::fromRaw(py * Fixed::One
+                                         + (2 * k + 1) * Fixed::One / (2 * samples));
+                auto d2 = (sy - y) * (sy - y);
+                if (d2 >= r2) {
+                    continue;
+                }
+                auto half = Fixed::sqrt(r2 - d2);
+                addSpan(area, x - half, x + half, samples > 1);
+            }
+            for (int i = 0; i < area.w; i++) {
+                auto c = coverage[i];
+                if (c >= full) {
+                    display.putPoint(area.x + i, py, color);
+                } else if (c > 0) {
+                    display.putPoint(area.x + i, py,
+                                     Color::Default.blend(color, c * 256 / full));
+                }
+            }
+        }
+    }
+
+    PropertyRef getProperty(Property property) override
+    {
+        if (property == Property::Gray) {
+            return PropertyRef{nullptr, &color};
+        }
+        return FixedEntity::getProperty(property);
+    }
+
+private:
+    bool antialiased() const noexcept
+    {
+        return antialiasing and not degraded;
+    }
+
+    // adds the span [a, b] of one sample row to the coverage of the area's row
+    void addSpan(const Rect &area, Fixed a, Fixed b, bool exact) const
+    {
+        if (not exact) {
+            // pixels whose center is inside
+            const auto half = Fixed::fromRaw(Fixed::One / 2);
+            int from = std::max(area.x, (a - half).ceil());
+            int to = std::min(area.right() - 1, (b - half).floor());
+            for (int px = from; px <= to; px++) {
+                coverage[px - area.x] += Fixed::One;
+            }
+            return;
+        }
+        int from = std::max(area.x, a.floor());
+        int to = std::min(area.right() - 1, b.ceil() - 1);
+        for (int px = from; px <= to; px++) {
+            int32_t left = std::max(a.getRaw(), px * Fixed::One);
+            int32_t right = std::min(b.getRaw(), (px + 1) * Fixed::One);
+            if (right > left) {
+                coverage[px - area.x] += right - left;
+            }
+        }
+    }
+
+    Fixed radius;
+    Color color;
+    Fixed dx, dy;
+    Rect world;
+    bool antialiasing = true;
+    bool degraded = false;
+
+    // what the last draw() put on the display
+    mutable Rect drawnBounds;
+    mutable Fixed drawnX, drawnY;
+    mutable Color drawnColor = Color::Default;
+    mutable bool drawnAntialiased = false;
+    mutable vector<int32_t> coverage;
+};
+
+/******************************************************************************/
+/* FileWatcher                                                                */
+
+// Notices when a file is rewritten or replaced. The directory is watched,
+// since editors and tools often replace files by renaming over them. If the
+// watch can't be set up, error says why and nothing is ever reported changed.
+class FileWatcher
+{
+public:
+    FileWatcher(const string &path, string &error)
+    {
+        auto slash = path.rfind('/');
+        auto dir = slash == string::npos ? string{"."} : path.substr(0, slash + 1);
+        name = slash == string::npos ? path : path.substr(slash + 1);
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            error = concat("inotify: ", strerror(errno));
+            return;
+        }
+        if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            error = concat(dir, ": ", strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~FileWatcher()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator = (const FileWatcher &) = delete;
+
+    // Drains pending events, never blocks
+    bool changed()
+    {
+        bool hit = false;
+        alignas(inotify_event) char buffer[4096];
+        ssize_t n;
+        while (fd >= 0 and (n = read(fd, buffer, sizeof(buffer))) > 0) {
+            for (char *p = buffer; p < buffer + n;) {
+                auto *event = reinterpret_cast<inotify_event *>(p);
+                if (event->len > 0 and name == event->name) {
+                    hit = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+        return hit;
+    }
+
+private:
+    int fd = -1;
+    string name;
+};
+
+/******************************************************************************/
+/* SceneFile                                                                  */
+
+// Binary scene: a header, a table directory and the tables' columns as plain
+// arrays, addressed by offsets from the start of the file. Loading maps the
+// file and draws straight out of the columns, nothing is parsed or copied;
+// loading only reads each column once to range check it, about 1.5 ms for a
+// million entities. Scene files must be replaced by renaming over them, as
+// convert does; a mapping of a file truncated in place would fault.
+class MappedScene : public IntEntity
+{
+public:
+    ~MappedScene()
+    {
+        if (data) {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    static uptr<MappedScene> load(const string &path, string &error)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = concat(path, ": ", strerror(errno));
+            return nullptr;
+        }
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 and st.st_size >= off_t(sizeof(Header))) {
+            map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED) {
+            error = concat(path, ": not a scene file");
+            return nullptr;
+        }
+        uptr<MappedScene> scene{new MappedScene};
+        scene->data = static_cast<const char *>(map);
+        scene->size = st.st_size;
+        scene->path = path;
+        if (not scene->validate(error)) {
+            error = concat(path, ": ", error);
+            return nullptr;
+        }
+        return scene;
+    }
+
+    // Larger values are rejected, so that bounds never overflow
+    static constexpr int32_t MaxRadius = 1024;
+    static constexpr int32_t MaxCoordinate = 1 << 28;
+
+    // Reads lines of "point X Y COLOR" and "circle X Y RADIUS COLOR", where a
+    // color is a palette index, a name like red, gray:N or rgb:R,G,B
+    static bool convert(std::istream &in, const string &path, string &error);
+
+    bool wantsUpdate() const override
+    {
+        return false;
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        // only reloads change anything
+        for (auto &r : changes.getRects()) {
+            damage.add(r);
+        }
+        if (changes.isAll()) {
+            damage.addAll();
+        }
+        changes.clear();
+    }
+
+    // Starts following changes to the file, see reload()
+    bool watch(string &error)
+    {
+        error.clear();
+        watcher = make_unique<FileWatcher>(path, error);
+        return error.empty();
+    }
+
+    // Checks the watched file; a broken rewrite keeps the live scene
+    bool reloadIfChanged(string &error)
+    {
+        if (not watcher or not watcher->changed()) {
+            return false;
+        }
+        return reload(error);
+    }
+
+    // Maps the file again and diffs the new tables against the live ones by
+    // kind and index: added, removed and changed entities damage where they
+    // were and where they are now, everything else stays on screen untouched.
+    bool reload(string &error)
+    {
+        auto fresh = load(path, error);
+        if (not fresh) {
+            return false;
+        }
+        for (auto kind : { Kind::Points, Kind::Circles }) {
+            diff(find(kind), fresh->find(kind), *fresh);
+        }
+        std::swap(data, fresh->data);
+        std::swap(size, fresh->size);
+        return true;
+    }
+
+    void draw(Display &display) const override
+    {
+        auto clip = display.getClip();
+        for (auto &t : tables()) {
+            auto *xs = column<int32_t>(t.x), *ys = column<int32_t>(t.y);
+            auto *colors = column<Color>(t.color);
+            switch (t.kind) {
+                case Kind::Points:
+                    display.putPoints(xs, ys, colors, t.count);
+                    break;
+                case Kind::Circles: {
+                    auto *radii = column<int32_t>(t.radius);
+                    for (uint32_t i = 0; i < t.count; i++) {
+                        int r = radii[i];
+                        if (Rect{xs[i] - r, ys[i] - r, 2 * r + 1, 2 * r + 1}.intersects(clip)) {
+                            Circle::drawShared(display, xs[i], ys[i], r, colors[i]);
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    size_t entities() const
+    {
+        size_t n = 0;
+        for (auto &t : tables()) {
+            n += t.count;
+        }
+        return n;
+    }
+
+private:
+    static constexpr char Magic[8] = { 'T', 'B', 'S', 'C', 'E', 'N', 'E', 0 };
+    static constexpr uint32_t Version = 1;
+
+    enum class Kind : uint32_t { Points = 1, Circles = 2 };
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t tables;
+        uint64_t size;      // of the whole file, catches truncation
+    };
+
+    // Columns a kind doesn't have are 0
+    struct Table
+    {
+        Kind kind;
+        uint32_t count;
+        uint64_t x, y, radius, color;
+    };
+
+    MappedScene() : IntEntity{0, 0} {}
+
+    const Table *find(Kind kind) const
+    {
+        for (auto &t : tables()) {
+            if (t.kind == kind) {
+                return &t;
+            }
+        }
+        return nullptr;
+    }
+
+    Rect bounds(const Table &t, uint32_t i) const
+    {
+        auto x = column<int32_t>(t.x)[i], y = column<int32_t>(t.y)[i];
+        if (t.kind == Kind::Circles) {
+            auto r = column<int32_t>(t.radius)[i];
+            return Rect{x - r, y - r, 2 * r + 1, 2 * r + 1};
+        }
+        return Rect{x, y, 1, 1};
+    }
+
+    void diff(const Table *before, const Table *after, const MappedScene &next)
+    {
+        uint32_t old = before ? before->count : 0, now = after ? after->count : 0;
+        for (uint32_t i = 0; i < std::max(old, now); i++) {
+            if (i >= now) {
+                changes.add(bounds(*before, i));
+            } else if (i >= old) {
+                changes.add(next.bounds(*after, i));
+            } else {
+                bool same = column<int32_t>(before->x)[i] == next.column<int32_t>(after->x)[i]
+                    and column<int32_t>(before->y)[i] == next.column<int32_t>(after->y)[i]
+                    and column<Color>(before->color)[i] == next.column<Color>(after->color)[i]
+                    and (before->kind != Kind::Circles or column<int32_t>(before->radius)[i]
+                         == next.column<int32_t>(after->radius)[i]);
+                if (not same) {
+                    changes.add(bounds(*before, i));
+                    changes.add(next.bounds(*after, i));
+                }
+            }
+        }
+    }
+
+    struct Tables
+    {
+        const Table *b, *e;
+        const Table *begin() const { return b; }
+        const Table *end() const { return e; }
+    };
+
+    const Header &header() const
+    {
+        return *reinterpret_cast<const Header *>(data);
+    }
+
+    Tables tables() const
+    {
+        auto *first = reinterpret_cast<const Table *>(data + sizeof(Header));
+        return Tables{first, first + header().tables};
+    }
+
+    template <typename T>
+    const T *column(uint64_t offset) const
+    {
+        return reinterpret_cast<const T *>(data + offset);
+    }
+
+    static bool inRange(const int32_t *values, uint32_t count, int32_t min, int32_t max)
+    {
+        return std::all_of(values, values + count,
+                           [=](int32_t v) { return v >= min and v <= max; });
+    }
+
+    // everything the drawing loops touch has to be inside the file, and every
+    // coordinate and radius small enough to do arithmetic on
+    bool validate(string &error) const
+    {
+        auto &h = header();
+        if (std::memcmp(h.magic, Magic, sizeof(Magic)) != 0) {
+            error = "not a scene file";
+            return false;
+        }
+        if (h.version != Version) {
+            error = concat("scene version ", h.version, ", expected ", Version);
+            return false;
+        }
+        if (h.size != size or h.tables > (size - sizeof(Header)) / sizeof(Table)) {
+            error = "truncated scene file";
+            return false;
+        }
+        auto fits = [this](uint64_t offset, uint64_t count, uint64_t elem) {
+            return offset != 0 and offset % elem == 0 and offset <= size
+                and count <= (size - offset) / elem;
+        };
+        // one table per kind, find() would only ever see the first
+        uint32_t kinds = 0;
+        for (auto &t : tables()) {
+            auto bit = uint32_t(1) << (uint32_t(t.kind) & 31);
+            if (kinds & bit) {
+                error = "duplicate scene table";
+                return false;
+            }
+            kinds |= bit;
+            bool ok = fits(t.x, t.count, 4) and fits(t.y, t.count, 4)
+                and fits(t.color, t.count, sizeof(Color));
+            if (t.kind == Kind::Circles) {
+                ok = ok and fits(t.radius, t.count, 4);
+            } else if (t.kind != Kind::Points) {
+                ok = false;
+            }
+            if (not ok) {
+                error = "corrupt scene table";
+                return false;
+            }
+            if (not inRange(column<int32_t>(t.x), t.count, -MaxCoordinate, MaxCoordinate)
+                    or not inRange(column<int32_t>(t.y), t.count, -MaxCoordinate, MaxCoordinate)
+                    or (t.kind == Kind::Circles and not inRange(
+                            column<int32_t>(t.radius), t.count, 0, MaxRadius))) {
+                error = "scene coordinate or radius out of range";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const char *data = nullptr;
+    size_t size = 0;
+    string path;
+    uptr<FileWatcher> watcher;
+    Damage changes;
+};
+
+inline bool parseColor(const string &text, Color &color)
+{
+    static const std::map<string, Color> names = {
+        { "default", Color::Default }, { "black", Color::Black },
+        { "red", Color::Red }, { "green", Color::Green },
+        { "yellow", Color::Yellow }, { "blue", Color::Blue },
+        { "magenta", Color::Magenta }, { "cyan", Color::Cyan },
+        { "white", Color::White },
+    };
+    auto name = names.find(text);
+    unsigned r, g, b;
+    if (name != names.end()) {
+        color = name->second;
+    } else if (std::sscanf(text.c_str(), "gray:%u", &r) == 1) {
+        color = Color::makeSOG(r);
+    } else if (std::sscanf(text.c_str(), "rgb:%u,%u,%u", &r, &g, &b) == 3) {
+        color = Color(r, g, b);
+    } else if (std::sscanf(text.c_str(), "%u", &r) == 1 and r < 256) {
+        color = Color(uint16_t(r));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool MappedScene::convert(std::istream &in, const string &path, string &error)
+{
+    struct Columns
+    {
+        vector<int32_t> x, y, radius;
+        vector<Color> color;
+    };
+    Columns points, circles;
+    string line;
+    for (int number = 1; std::getline(in, line); number++) {
+        std::istringstream fields{line};
+        string kind, color;
+        int x, y, radius = 0;
+        if (not (fields >> kind) or kind[0] == '#') {
+            continue;
+        }
+        bool ok = kind == "point" ? bool(fields >> x >> y >> color)
+                : kind == "circle" ? bool(fields >> x >> y >> radius >> color)
+                : false;
+        Color c;
+        if (not ok or not parseColor(color, c)) {
+            error = concat("line ", number, ": expected point X Y COLOR or circle X Y R COLOR");
+            return false;
+        }
+        if (std::abs(x) > MaxCoordinate or std::abs(y) > MaxCoordinate
+                or radius < 0 or radius > MaxRadius) {
+            error = concat("line ", number, ": coordinate or radius out of range");
+            return false;
+        }
+        auto &t = kind == "point" ? points : circles;
+        t.x.push_back(x);
+        t.y.push_back(y);
+        t.color.push_back(c);
+        if (kind == "circle") {
+            t.radius.push_back(radius);
+        }
+    }
+
+    vector<const Columns *> used;
+    vector<Table> tables;
+    for (auto *t : { &points, &circles }) {
+        if (not t->x.empty()) {
+            used.push_back(t);
+            tables.push_back(Table{ t == &points ? Kind::Points : Kind::Circles,
+                                    uint32_t(t->x.size()), 0, 0, 0, 0 });
+        }
+    }
+    // lay the columns out after the directory, 8 byte aligned
+    uint64_t offset = sizeof(Header) + tables.size() * sizeof(Table);
+    auto place = [&offset](uint64_t bytes) {
+        offset = (offset + 7) & ~uint64_t(7);
+        auto at = offset;
+        offset += bytes;
+        return at;
+    };
+    for (size_t i = 0; i < tables.size(); i++) {
+        auto &t = tables[i];
+        t.x = place(t.count * 4);
+        t.y = place(t.count * 4);
+        if (t.kind == Kind::Circles) {
+            t.radius = place(t.count * 4);
+        }
+        t.color = place(t.count * sizeof(Color));
+    }
+    Header header{};
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+    header.version = Version;
+    header.tables = tables.size();
+    header.size = offset;
+
+    string file(offset, '\0');
+    std::memcpy(&file[0], &header, sizeof(header));
+    std::memcpy(&file[sizeof(header)], tables.data(), tables.size() * sizeof(Table));
+    auto copy = [&file](uint64_t at, const auto &column) {
+        std::memcpy(&file[at], column.data(), column.size() * sizeof(column[0]));
+    };
+    for (size_t i = 0; i < tables.size(); i++) {
+        copy(tables[i].x, used[i]->x);
+        copy(tables[i].y, used[i]->y);
+        if (tables[i].kind == Kind::Circles) {
+            copy(tables[i].radius, used[i]->radius);
+        }
+        copy(tables[i].color, used[i]->color);
+    }
+    // written aside and renamed over, live mappings of the old file stay valid
+    auto temporary = path + ".tmp";
+    std::ofstream out{temporary, std::ios::binary};
+    if (not out.write(file.data(), file.size()) or not out.flush()) {
+        error = concat(temporary, ": ", strerror(errno));
+        return false;
+    }
+    out.close();
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        error = concat(path, ": ", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/******************************************************************************/
+/* Sprite                                                                     */
+
+class Sprite : public IntEntity
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Sprite(int x, int y, SpriteSheetPtr sheet, int dx = 0, int dy = 0)
+        : IntEntity{x, y}, sheet{move(sheet)}, dx{dx}, dy{dy} {}
+
+    void update() override
+    {
+        auto elapsed = Clock::now() - start;
+        frame = elapsed / sheet->frameTime % sheet->frames.size();
+        x += dx;
+        y += dy;
+    }
+
+    void draw(Display &display) const override
+    {
+        sheet->frames[frame].draw(display, x, y);
+        getBounds(drawnBounds);
+        drawnFrame = frame;
+    }
+
+    bool getBounds(Rect &bounds) const override
+    {
+        auto &bitmap = sheet->frames[frame];
+        bounds = Rect{x, y, bitmap.getWidth(), bitmap.getHeight()};
+        return true;
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        Rect bounds;
+        getBounds(bounds);
+        if (bounds != drawnBounds or frame != drawnFrame) {
+            damage.add(drawnBounds);
+            damage.add(bounds);
+        }
+    }
+
+private:
+    SpriteSheetPtr sheet;
+    int dx, dy;
+    size_t frame = 0;
+    Clock::time_point start = Clock::now();
+
+    mutable Rect drawnBounds;
+    mutable size_t drawnFrame = 0;
+};
+
+/******************************************************************************/
+/* SceneNode                                                                  */
+
+// Retained scene graph. A node's x, y are relative to its parent and its
+// optional content entity is drawn in the node's coordinates. Bounds are
+// cached per subtree in local coordinates, so moving a node touches only the
+// node itself: its subtree's bounds move along with it and it reports one
+// damage rect for where the subtree was and one for where it is now.
+//
+// Content is assumed static unless the node is animated; only animated nodes
+// get their content updated and polled for damage every frame.
+class SceneNode : public IntEntity
+{
+public:
+    explicit SceneNode(int x = 0, int y = 0, uptr<EntityBase> content = nullptr,
+                       bool animated = false)
+        : IntEntity{x, y}, content{move(content)}, animated{animated},
+          animatedBelow{animated} {}
+
+    SceneNode &add(uptr<SceneNode> child)
+    {
+        child->parent = this;
+        for (auto *n = this; n; n = n->parent) {
+            n->animatedBelow += child->animatedBelow;
+        }
+        children.push_back(move(child));
+        children.back()->moved = true;
+        children.back()->markPending();
+        invalidateBounds();
+        return *children.back();
+    }
+
+    SceneNode &addContent(uptr<EntityBase> entity, bool animated = false)
+    {
+        return add(make_unique<SceneNode>(0, 0, move(entity), animated));
+    }
+
+    void moveTo(int nx, int ny)
+    {
+        if (nx == x and ny == y) {
+            return;
+        }
+        x = nx;
+        y = ny;
+        moved = true;
+        markPending();
+        if (parent) {
+            parent->invalidateBounds();
+        }
+    }
+
+    void moveBy(int dx, int dy)
+    {
+        moveTo(x + dx, y + dy);
+    }
+
+    void update() override
+    {
+        if (animatedBelow == 0) {
+            return;
+        }
+        if (animated and content) {
+            content->update();
+        }
+        for (auto &c : children) {
+            c->update();
+        }
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        refresh(damage, 0, 0, false);
+    }
+
+    void draw(Display &display) const override
+    {
+        drawAt(display, 0, 0);
+    }
+
+    bool getBounds(Rect &bounds) const override
+    {
+        bounds = placed;
+        return true;
+    }
+
+private:
+    static Rect shifted(const Rect &r, int dx, int dy) noexcept
+    {
+        return r.empty() ? r : Rect{r.x + dx, r.y + dy, r.w, r.h};
+    }
+
+    // Flags the path to the root so refresh() can find this node
+    void markPending()
+    {
+        for (auto *n = parent; n and not n->childPending; n = n->parent) {
+            n->childPending = true;
+        }
+    }
+
+    void invalidateBounds()
+    {
+        for (auto *n = this; n and not n->boundsDirty; n = n->parent) {
+            n->boundsDirty = true;
+            n->markPending();
+        }
+    }
+
+    // originX, originY is the parent's position on the display
+    void refresh(Damage &damage, int originX, int originY, bool ancestorMoved)
+    {
+        if (not moved and not childPending and not boundsDirty and animatedBelow == 0) {
+            return;
+        }
+        const bool movedHere = moved and not ancestorMoved;
+        if (movedHere) {
+            damage.add(shifted(placed, originX, originY));
+        }
+
+        const int wx = originX + x, wy = originY + y;
+        if (animated and content) {
+            Damage local;
+            content->collectDamage(local);
+            if (local.isAll()) {
+                damage.addAll();
+            }
+            for (auto &r : local.getRects()) {
+                damage.add(shifted(r, wx, wy));
+            }
+            if (not local.empty()) {
+                boundsDirty = true;
+            }
+        }
+
+        if (childPending or animatedBelow > int(animated)) {
+            for (auto &c : children) {
+                c->refresh(damage, wx, wy, ancestorMoved or moved);
+            }
+        }
+
+        if (boundsDirty) {
+            localBounds = contentBounds();
+            for (auto &c : children) {
+                localBounds = localBounds.united(c->placed);
+            }
+        }
+        placed = shifted(localBounds, x, y);
+        if (movedHere) {
+            damage.add(shifted(placed, originX, originY));
+        }
+        moved = childPending = boundsDirty = false;
+    }
+
+    Rect contentBounds() const
+    {
+        Rect r;
+        if (content and not content->getBounds(r)) {
+            // unknown extent, never cull it
+            r = Rect{-(1 << 28), -(1 << 28), 1 << 29, 1 << 29};
+        }
+        return r;
+    }
+
+    void drawAt(Display &display, int originX, int originY) const
+    {
+        const int wx = originX + x, wy = originY + y;
+        if (not shifted(placed, originX, originY).intersects(display.getClip())) {
+            return;
+        }
+        if (content) {
+            TranslatedDisplay local{display, wx, wy};
+            content->draw(local);
+        }
+        for (auto &c : children) {
+            c->drawAt(display, wx, wy);
+        }
+    }
+
+private:
+    SceneNode *parent = nullptr;
+    vector<uptr<SceneNode> > children;
+    uptr<EntityBase> content;
+
+    // subtree bounds in this node's coordinates, and in the parent's
+    Rect localBounds;
+    Rect placed;
+
+    bool animated;
+    int animatedBelow;
+    bool moved = true;
+    bool childPending = false;
+    bool boundsDirty = true;
+};
+
+/******************************************************************************/
+/* ParticleSystem                                                             */
+
+// Particles are kept as a structure of arrays so that integration is a handful
+// of straight loops over floats which the compiler turns into SIMD code.
+class ParticleSystem : public IntEntity
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ParticleSystem(int x, int y, size_t capacity, float maxLife = 3.0f)
+        : IntEntity{x, y}, capacity{capacity}, maxLife{maxLife}
+    {
+        reserve(capacity);
+    }
+
+    size_t size() const noexcept
+    {
+        return life.size();
+    }
+
+    void emit(size_t count)
+    {
+        count = std::min(count, capacity - size());
+        std::uniform_real_distribution<float> spread{-1.0f, 1.0f};
+        std::uniform_real_distribution<float> lifetime{maxLife / 4, maxLife};
+        for (size_t i = 0; i < count; i++) {
+            posX.push_back(x);
+            posY.push_back(y);
+            velX.push_back(spread(rng) * 30.0f);
+            velY.push_back(-40.0f + spread(rng) * 10.0f);
+            life.push_back(lifetime(rng));
+            color.push_back(Palette[rng() % Palette.size()]);
+        }
+        pointX.resize(size());
+        pointY.resize(size());
+    }
+
+    void update() override
+    {
+        auto now = Clock::now();
+        float dt = std::chrono::duration<float>(now - lastUpdate).count();
+        lastUpdate = now;
+        dt = std::min(dt, 0.1f);
+
+        integrate(dt);
+        compact();
+
+        emitDebt += capacity / maxLife * dt;
+        emit(size_t(emitDebt));
+        emitDebt -= size_t(emitDebt);
+    }
+
+    void draw(Display &display) const override
+    {
+        const size_t n = size();
+        const float *px = posX.data(), *py = posY.data();
+        int *ix = pointX.data(), *iy = pointY.data();
+        for (size_t i = 0; i < n; i++) {
+            ix[i] = int(px[i]);
+            iy[i] = int(py[i]);
+        }
+        display.putPoints(ix, iy, color.data(), n);
+    }
+
+private:
+    void reserve(size_t n)
+    {
+        for (auto *v : { &posX, &posY, &velX, &velY, &life }) {
+            v->reserve(n);
+        }
+        color.reserve(n);
+        pointX.reserve(n);
+        pointY.reserve(n);
+    }
+
+    void integrate(float dt)
+    {
+        const size_t n = size();
+        float *__restrict px = posX.data();
+        float *__restrict py = posY.data();
+        float *__restrict vx = velX.data();
+        float *__restrict vy = velY.data();
+        float *__restrict lf = life.data();
+        const float g = gravity * dt;
+        for (size_t i = 0; i < n; i++) {
+            vy[i] += g;
+            px[i] += vx[i] * dt;
+            py[i] += vy[i] * dt;
+            lf[i] -= dt;
+        }
+    }
+
+    // swap-remove: the last live particle is moved into the slot of a dead one,
+    // so the arrays stay dense without shifting anything
+    void compact()
+    {
+        size_t n = size();
+        for (size_t i = 0; i < n;) {
+            if (life[i] > 0.0f) {
+                i++;
+                continue;
+            }
+            n--;
+            posX[i] = posX[n];
+            posY[i] = posY[n];
+            velX[i] = velX[n];
+            velY[i] = velY[n];
+            life[i] = life[n];
+            color[i] = color[n];
+        }
+        for (auto *v : { &posX, &posY, &velX, &velY, &life }) {
+            v->resize(n);
+        }
+        color.resize(n, Color::Default);
+        pointX.resize(n);
+        pointY.resize(n);
+    }
+
+private:
+    static const std::array<Color, 4> Palette;
+
+    size_t capacity;
+    float maxLife;
+    float gravity = 20.0f;
+    float emitDebt = 0.0f;
+    Clock::time_point lastUpdate = Clock::now();
+    std::minstd_rand rng;
+
+    vector<float> posX, posY;
+    vector<float> velX, velY;
+    vector<float> life;
+    vector<Color> color;
+
+    // scratch buffers for the batched point path
+    mutable vector<int> pointX, pointY;
+};
+
+const std::array<Color, 4> ParticleSystem::Palette = {
+    Color{255, 255, 0}, Color{255, 128, 0}, Color{255, 0, 0}, Color{255, 255, 255},
+};
+
+/******************************************************************************/
+/* LifeGrid                                                                   */
+
+// Conway's game of life on a toroidal bit-packed grid, one bit per cell and
+// 64 cells per word. Neighbour counts are computed with bit-sliced adders so
+// every logic op advances a whole word (or a vector of them) at once. The
+// grid wraps at its width; the bits past it in each row's last word stay clear.
+class LifeGrid : public IntEntity
+{
+public:
+    using Word = uint64_t;
+    static constexpr int WordBits = 64;
+
+    LifeGrid(int x, int y, int width, int height, Color alive = Color{0, 255, 0})
+        : IntEntity{x, y}, width{width},
+          words{(width + WordBits - 1) / WordBits}, rows{height},
+          cells(words * rows), next(words * rows), alive{alive} {}
+
+    int getWidth() const noexcept
+    {
+        return width;
+    }
+
+    int getHeight() const noexcept
+    {
+        return rows;
+    }
+
+    void set(int cx, int cy, bool value)
+    {
+        if (cx < 0 or cy < 0 or cx >= width or cy >= rows) {
+            return;
+        }
+        Word bit = Word(1) << (cx % WordBits);
+        auto &w = cells[cy * words + cx / WordBits];
+        w = value ? w | bit : w & ~bit;
+        touched = true;
+    }
+
+    bool get(int cx, int cy) const
+    {
+        return cells[cy * words + cx / WordBits] >> (cx % WordBits) & 1;
+    }
+
+    template <typename Rng>
+    void randomize(Rng &rng)
+    {
+        for (auto &w : cells) {
+            // ~25% density
+            w = (Word(rng()) << 32 | rng()) & (Word(rng()) << 32 | rng());
+        }
+        for (int row = 0; row < rows; row++) {
+            cells[row * words + words - 1] &= lastMask();
+        }
+        touched = true;
+    }
+
+    void update() override
+    {
+        threadPool().parallelFor(0, rows, [this](size_t from, size_t to) {
+            for (size_t row = from; row < to; row++) {
+                stepRow(row);
+            }
+        });
+        cells.swap(next);
+    }
+
+    // Damage is limited to runs of words that differ from the previous
+    // generation, which after the swap is kept in `next`
+    void collectDamage(Damage &damage) override
+    {
+        if (touched) {
+            damage.add(Rect{x, y, getWidth(), rows});
+            touched = false;
+            return;
+        }
+        for (int row = 0; row < rows; row++) {
+            const Word *cur = &cells[row * words], *prev = &next[row * words];
+            for (int w = 0; w < words;) {
+                if (cur[w] == prev[w]) {
+                    w++;
+                    continue;
+                }
+                int first = w;
+                while (w < words and cur[w] != prev[w]) {
+                    w++;
+                }
+                int from = first * WordBits;
+                damage.add(Rect{x + from, y + row,
+                                std::min(w * WordBits, width) - from, 1});
+            }
+        }
+    }
+
+    void draw(Display &display) const override
+    {
+        auto area = display.getClip().intersected(Rect{x, y, getWidth(), rows});
+        int firstWord = (area.x - x) / WordBits;
+        int lastWord = (area.right() - x + WordBits - 1) / WordBits;
+        for (int row = area.y - y; row < area.bottom() - y; row++) {
+            const Word *line = &cells[row * words];
+            for (int w = firstWord; w < lastWord; w++) {
+                for (Word bits = line[w]; bits; bits &= bits - 1) {
+                    int bit = __builtin_ctzll(bits);
+                    display.putPoint(x + w * WordBits + bit, y + row, alive);
+                }
+            }
+        }
+    }
+
+private:
+    // Four words processed together; with AVX2 enabled this is one ymm register
+    // per value, otherwise the compiler splits it into narrower ops.
+    using Lanes = Word __attribute__((vector_size(4 * sizeof(Word))));
+    static constexpr int LaneWords = sizeof(Lanes) / sizeof(Word);
+
+    template <typename W>
+    static W nextGeneration(W up, W upL, W upR, W midL, W mid, W midR,
+                            W down, W downL, W downR)
+    {
+        // 2-bit sums of the three cells above and below
+        W u0 = up ^ upL ^ upR, u1 = (up & upL) | (upR & (up ^ upL));
+        W d0 = down ^ downL ^ downR, d1 = (down & downL) | (downR & (down ^ downL));
+        // left and right neighbours on the same row
+        W m0 = midL ^ midR, m1 = midL & midR;
+
+        // above + below, a 3-bit sum
+        W t0 = u0 ^ d0, c0 = u0 & d0;
+        W t1 = u1 ^ d1 ^ c0, t2 = (u1 & d1) | (c0 & (u1 ^ d1));
+        // + same row; only bits 0 and 1 and whether it's 4 or more matter
+        W s0 = t0 ^ m0, k0 = t0 & m0;
+        W s1 = t1 ^ m1 ^ k0, k1 = (t1 & m1) | (k0 & (t1 ^ m1));
+        W many = t2 | k1;
+
+        // 3 neighbours, or 2 neighbours and alive
+        return s1 & ~many & (s0 | mid);
+    }
+
+    template <typename W>
+    static W load(const Word *p)
+    {
+        W w;
+        std::memcpy(&w, p, sizeof(w));
+        return w;
+    }
+
+    // Bits shifted towards higher x, i.e. each cell sees its left neighbour
+    static Word left(Word w, Word prev) { return w << 1 | prev >> (WordBits - 1); }
+    static Word right(Word w, Word next) { return w >> 1 | next << (WordBits - 1); }
+
+    // The cells of a row's last word that are inside the grid
+    Word lastMask() const
+    {
+        int bits = width - (words - 1) * WordBits;
+        return bits == WordBits ? ~Word(0) : (Word(1) << bits) - 1;
+    }
+
+    void stepRow(int row)
+    {
+        const Word *up = &cells[(row + rows - 1) % rows * words];
+        const Word *mid = &cells[row * words];
+        const Word *down = &cells[(row + 1) % rows * words];
+        Word *out = &next[row * words];
+
+        // the first cell's left neighbour is the last cell and the other way
+        // round, wherever in its word the last cell is
+        const int lastBit = (width - 1) % WordBits;
+        auto scalar = [&](int w) {
+            auto l = [&](const Word *r) {
+                return left(r[w], w > 0 ? r[w - 1] : (r[words - 1] >> lastBit) << (WordBits - 1));
+            };
+            auto rt = [&](const Word *r) {
+                return w + 1 < words ? right(r[w], r[w + 1]) : r[w] >> 1 | (r[0] & 1) << lastBit;
+            };
+            out[w] = nextGeneration(up[w], l(up), rt(up), l(mid), mid[w], rt(mid),
+                                    down[w], l(down), rt(down));
+            if (w + 1 == words) {
+                out[w] &= lastMask();
+            }
+        };
+
+        // the first and last words wrap around, the rest go in vectors
+        scalar(0);
+        int w = 1;
+        for (; w + LaneWords < words; w += LaneWords) {
+            auto vector = [&](const Word *r, Lanes &l, Lanes &c, Lanes &rr) {
+                c = load<Lanes>(r + w);
+                Lanes p = load<Lanes>(r + w - 1), n = load<Lanes>(r + w + 1);
+                l = c << 1 | p >> (WordBits - 1);
+                rr = c >> 1 | n << (WordBits - 1);
+            };
+            Lanes ul, u, ur, ml, m, mr, dl, d, dr;
+            vector(up, ul, u, ur);
+            vector(mid, ml, m, mr);
+            vector(down, dl, d, dr);
+            Lanes res = nextGeneration(u, ul, ur, ml, m, mr, d, dl, dr);
+            std::memcpy(out + w, &res, sizeof(res));
+        }
+        for (; w < words; w++) {
+            scalar(w);
+        }
+    }
+
+private:
+    int width;
+    int words;
+    int rows;
+    vector<Word> cells;
+    vector<Word> next;
+    Color alive;
+    bool touched = true;
+};
+
+/******************************************************************************/
+/* Fractal                                                                    */
+
+// Mandelbrot / Julia explorer. The plane is cut into tiles of TileSize pixels
+// at power-of-two zoom levels, so panning and zooming back reuse tiles that
+// were already computed. Missing tiles are computed across the thread pool,
+// Lanes pixels at a time.
+class Fractal : public IntEntity
+{
+public:
+    static constexpr int TileSize = 32;
+    static constexpr int Lanes = 8;
+    static constexpr int MaxLevel = 24;
+    static constexpr size_t MaxTiles = 4096;
+
+    Fractal(int x, int y, int width, int height)
+        : IntEntity{x, y}, width{width}, height{height}
+    {
+        centerOn(-0.5, 0.0);
+    }
+
+    void update() override
+    {
+        // only keys that move the view or switch the set redraw it
+        bool moved = true;
+        switch (tb->getCurrentKey()) {
+            case TB_KEY_ARROW_LEFT:  originX -= width / 8;  break;
+            case TB_KEY_ARROW_RIGHT: originX += width / 8;  break;
+            case TB_KEY_ARROW_UP:    originY -= height / 8; break;
+            case TB_KEY_ARROW_DOWN:  originY += height / 8; break;
+            case '+': moved = zoom(+1); break;
+            case '-': moved = zoom(-1); break;
+            case 'j': julia = not julia; break;
+            default: moved = false; break;
+        }
+        if (computeVisible() or moved) {
+            changed = true;
+        }
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        if (changed) {
+            damage.add(Rect{x, y, width, height});
+            changed = false;
+        }
+    }
+
+    void draw(Display &display) const override
+    {
+        auto area = display.getClip().intersected(Rect{x, y, width, height});
+        if (area.empty()) {
+            return;
+        }
+        // area in plane pixels at the current level
+        int left = originX + area.x - x, top = originY + area.y - y;
+        int right = left + area.w, bottom = top + area.h;
+        for (int ty = floorDiv(top, TileSize); ty * TileSize < bottom; ty++) {
+            for (int tx = floorDiv(left, TileSize); tx * TileSize < right; tx++) {
+                auto it = tiles.find(tileKey(tx, ty));
+                if (it == tiles.end()) {
+                    continue;
+                }
+                // clip the tile to the area here, the display only knows
+                // about its own clip rect
+                int px = tx * TileSize, py = ty * TileSize;
+                int l = std::max(px, left), t = std::max(py, top);
+                int r = std::min(px + TileSize, right), b = std::min(py + TileSize, bottom);
+                const Color *src = &it->second.pixels[(t - py) * TileSize + (l - px)];
+                display.blit(x + l - originX, y + t - originY, r - l, b - t,
+                             src, TileSize);
+            }
+        }
+    }
+
+private:
+    struct Tile
+    {
+        vector<Color> pixels = vector<Color>(TileSize * TileSize, Color::Default);
+        uint64_t lastUsed = 0;
+    };
+
+    static int floorDiv(int a, int b) noexcept
+    {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    }
+
+    double scale() const noexcept
+    {
+        return std::ldexp(1.0 / 32, -level);
+    }
+
+    int maxIterations() const noexcept
+    {
+        return std::min(64 + 32 * level, 2048);
+    }
+
+    void centerOn(double re, double im)
+    {
+        originX = int(std::floor(re / scale())) - width / 2;
+        originY = int(std::floor(im / scale())) - height / 2;
+    }
+
+    // Returns whether the level changed
+    bool zoom(int delta)
+    {
+        int next = std::min(std::max(level + delta, 0), MaxLevel);
+        if (next == level) {
+            return false;
+        }
+        double re = (originX + width / 2) * scale();
+        double im = (originY + height / 2) * scale();
+        level = next;
+        centerOn(re, im);
+        return true;
+    }
+
+    uint64_t tileKey(int tx, int ty) const noexcept
+    {
+        return uint64_t(level) << 58 | uint64_t(julia) << 57
+            | (uint64_t(uint32_t(tx)) & 0xfffffff) << 28
+            | (uint64_t(uint32_t(ty)) & 0xfffffff);
+    }
+
+    // Computes the visible tiles that aren't cached yet, returns whether there
+    // were any
+    bool computeVisible()
+    {
+        frame++;
+        vector<std::pair<int, int> > missing;
+        for (int ty = floorDiv(originY, TileSize); ty * TileSize < originY + height; ty++) {
+            for (int tx = floorDiv(originX, TileSize); tx * TileSize < originX + width; tx++) {
+                auto it = tiles.find(tileKey(tx, ty));
+                if (it != tiles.end()) {
+                    it->second.lastUsed = frame;
+                } else {
+                    missing.emplace_back(tx, ty);
+                }
+            }
+        }
+        if (missing.empty()) {
+            return false;
+        }
+
+        vector<Tile *> computed;
+        for (auto &m : missing) {
+            auto &tile = tiles[tileKey(m.first, m.second)];
+            tile.lastUsed = frame;
+            computed.push_back(&tile);
+        }
+        threadPool().parallelFor(0, missing.size(), [&](size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) {
+                computeTile(missing[i].first, missing[i].second, *computed[i]);
+            }
+        });
+        evict();
+        return true;
+    }
+
+    void computeTile(int tx, int ty, Tile &tile) const
+    {
+        const double step = scale();
+        const int limit = maxIterations();
+        uint16_t counts[TileSize];
+        for (int row = 0; row < TileSize; row++) {
+            double im = (ty * TileSize + row) * step;
+            double re = tx * TileSize * step;
+            for (int col = 0; col < TileSize; col += Lanes) {
+                escapeTimes(re + col * step, im, step, limit, counts + col);
+            }
+            for (int col = 0; col < TileSize; col++) {
+                tile.pixels[row * TileSize + col] =
+                    counts[col] >= limit ? InsideColor : Palette[counts[col] & 0xff];
+            }
+        }
+    }
+
+    // Iterates Lanes points of a row in lockstep; the lane loops have no
+    // branches so they compile to vector code
+    void escapeTimes(double re, double im, double step, int limit,
+                     uint16_t *out) const
+    {
+        double zr[Lanes], zi[Lanes], cr[Lanes], ci[Lanes];
+        int count[Lanes];
+        for (int l = 0; l < Lanes; l++) {
+            double pr = re + l * step;
+            zr[l] = julia ? pr : 0.0;
+            zi[l] = julia ? im : 0.0;
+            cr[l] = julia ? JuliaRe : pr;
+            ci[l] = julia ? JuliaIm : im;
+            count[l] = 0;
+        }
+        for (int n = 0; n < limit; n++) {
+            int active = 0;
+            for (int l = 0; l < Lanes; l++) {
+                double r2 = zr[l] * zr[l], i2 = zi[l] * zi[l];
+                int inside = r2 + i2 <= 4.0;
+                double nzi = 2.0 * zr[l] * zi[l] + ci[l];
+                double nzr = r2 - i2 + cr[l];
+                zr[l] = inside ? nzr : zr[l];
+                zi[l] = inside ? nzi : zi[l];
+                count[l] += inside;
+                active |= inside;
+            }
+            if (not active) {
+                break;
+            }
+        }
+        for (int l = 0; l < Lanes; l++) {
+            out[l] = count[l];
+        }
+    }
+
+    // Drops the least recently used half of the cache once it's full
+    void evict()
+    {
+        if (tiles.size() <= MaxTiles) {
+            return;
+        }
+        vector<uint64_t> stamps;
+        for (auto &t : tiles) {
+            stamps.push_back(t.second.lastUsed);
+        }
+        auto median = stamps.begin() + stamps.size() / 2;
+        std::nth_element(stamps.begin(), median, stamps.end());
+        for (auto it = tiles.begin(); it != tiles.end();) {
+            if (it->second.lastUsed < *median) {
+                it = tiles.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static std::array<Color, 256> makePalette()
+    {
+        std::array<Color, 256> palette;
+        for (int i = 0; i < 256; i++) {
+            double t = i / 256.0 * 2 * M_PI;
+            palette[i] = Color(128 + 127 * std::sin(t),
+                               128 + 127 * std::sin(t + 2 * M_PI / 3),
+                               128 + 127 * std::sin(t + 4 * M_PI / 3));
+        }
+        return palette;
+    }
+
+private:
+    static const std::array<Color, 256> Palette;
+    static constexpr Color InsideColor = Color{0, 0, 0};
+    static constexpr double JuliaRe = -0.8;
+    static constexpr double JuliaIm = 0.156;
+
+    int width, height;
+    int level = 0;
+    int originX = 0, originY = 0;
+    bool julia = false;
+    bool changed = true;
+    uint64_t frame = 0;
+    std::unordered_map<uint64_t, Tile> tiles;
+};
+
+const std::array<Color, 256> Fractal::Palette = Fractal::makePalette();
+
+/******************************************************************************/
+/* Mat4                                                                       */
+
+// Column-major 4x4 matrix, element (row, col) is m[col * 4 + row]
+struct Mat4
+{
+    alignas(16) float m[16] = {};
+
+    static Mat4 identity()
+    {
+        Mat4 r;
+        r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1.0f;
+        return r;
+    }
+
+    static Mat4 translation(float x, float y, float z)
+    {
+        auto r = identity();
+        r.m[12] = x;
+        r.m[13] = y;
+        r.m[14] = z;
+        return r;
+    }
+
+    static Mat4 rotationX(float a)
+    {
+        auto r = identity();
+        r.m[5] = std::cos(a);
+        r.m[6] = std::sin(a);
+        r.m[9] = -std::sin(a);
+        r.m[10] = std::cos(a);
+        return r;
+    }
+
+    static Mat4 rotationY(float a)
+    {
+        auto r = identity();
+        r.m[0] = std::cos(a);
+        r.m[2] = -std::sin(a);
+        r.m[8] = std::sin(a);
+        r.m[10] = std::cos(a);
+        return r;
+    }
+
+    static Mat4 perspective(float fovY, float aspect, float near, float far)
+    {
+        Mat4 r;
+        float f = 1.0f / std::tan(fovY / 2);
+        r.m[0] = f / aspect;
+        r.m[5] = f;
+        r.m[10] = (far + near) / (near - far);
+        r.m[11] = -1.0f;
+        r.m[14] = 2 * far * near / (near - far);
+        return r;
+    }
+
+    Mat4 operator * (const Mat4 &o) const
+    {
+        Mat4 r;
+        for (int col = 0; col < 4; col++) {
+            for (int k = 0; k < 4; k++) {
+                for (int row = 0; row < 4; row++) {
+                    r.m[col * 4 + row] += m[k * 4 + row] * o.m[col * 4 + k];
+                }
+            }
+        }
+        return r;
+    }
+
+    // Transforms n points stored as separate x/y/z arrays (w = 1). Each output
+    // row is a multiply-add over whole arrays, which vectorizes across points.
+    void transform(const float *x, const float *y, const float *z, size_t n,
+                   float *ox, float *oy, float *oz, float *ow) const
+    {
+        float *out[4] = { ox, oy, oz, ow };
+        for (int row = 0; row < 4; row++) {
+            const float a = m[row], b = m[4 + row], c = m[8 + row], d = m[12 + row];
+            float *__restrict o = out[row];
+            for (size_t i = 0; i < n; i++) {
+                o[i] = a * x[i] + b * y[i] + c * z[i] + d;
+            }
+        }
+    }
+};
+
+/******************************************************************************/
+/* Mesh                                                                       */
+
+struct Mesh
+{
+    vector<float> x, y, z;
+    vector<float> nx, ny, nz;
+    vector<uint32_t> indices;
+
+    size_t vertices() const noexcept
+    {
+        return x.size();
+    }
+
+    size_t triangles() const noexcept
+    {
+        return indices.size() / 3;
+    }
+
+    void addVertex(float vx, float vy, float vz)
+    {
+        x.push_back(vx);
+        y.push_back(vy);
+        z.push_back(vz);
+    }
+
+    // Area-weighted vertex normals
+    void computeNormals()
+    {
+        nx.assign(vertices(), 0.0f);
+        ny.assign(vertices(), 0.0f);
+        nz.assign(vertices(), 0.0f);
+        for (size_t t = 0; t < indices.size(); t += 3) {
+            auto a = indices[t], b = indices[t + 1], c = indices[t + 2];
+            float ux = x[b] - x[a], uy = y[b] - y[a], uz = z[b] - z[a];
+            float vx = x[c] - x[a], vy = y[c] - y[a], vz = z[c] - z[a];
+            float cx = uy * vz - uz * vy, cy = uz * vx - ux * vz, cz = ux * vy - uy * vx;
+            for (auto i : { a, b, c }) {
+                nx[i] += cx;
+                ny[i] += cy;
+                nz[i] += cz;
+            }
+        }
+        for (size_t i = 0; i < vertices(); i++) {
+            float len = std::sqrt(nx[i] * nx[i] + ny[i] * ny[i] + nz[i] * nz[i]);
+            if (len > 0) {
+                nx[i] /= len;
+                ny[i] /= len;
+                nz[i] /= len;
+            }
+        }
+    }
+
+    // Reads the 'v' and 'f' lines of a Wavefront OBJ file, faces with more
+    // than three vertices are split into fans. Everything else is ignored.
+    static bool loadObj(const string &path, Mesh &mesh, string &error)
+    {
+        std::ifstream in{path};
+        if (not in) {
+            error = concat("can't open '", path, "'");
+            return false;
+        }
+        mesh = Mesh{};
+        string line;
+        for (int lineNo = 1; std::getline(in, line); lineNo++) {
+            stringstream ss{line};
+            string tag;
+            ss >> tag;
+            if (tag == "v") {
+                float vx, vy, vz;
+                if (not (ss >> vx >> vy >> vz)) {
+                    error = concat(path, ':', lineNo, ": bad vertex");
+                    return false;
+                }
+                mesh.addVertex(vx, vy, vz);
+            } else if (tag == "f") {
+                vector<uint32_t> face;
+                string ref;
+                while (ss >> ref) {
+                    // v, v/vt, v//vn or v/vt/vn; negative indices are relative
+                    long i = std::strtol(ref.c_str(), nullptr, 10);
+                    i = i < 0 ? long(mesh.vertices()) + i : i - 1;
+                    if (i < 0 or i >= long(mesh.vertices())) {
+                        error = concat(path, ':', lineNo, ": bad vertex index");
+                        return false;
+                    }
+                    face.push_back(i);
+                }
+                for (size_t k = 2; k < face.size(); k++) {
+                    mesh.indices.insert(mesh.indices.end(),
+                                        { face[0], face[k - 1], face[k] });
+                }
+            }
+        }
+        mesh.computeNormals();
+        return true;
+    }
+
+    static Mesh torus(float major, float minor, int rings, int sides)
+    {
+        Mesh mesh;
+        for (int r = 0; r < rings; r++) {
+            float u = 2 * M_PI * r / rings;
+            for (int s = 0; s < sides; s++) {
+                float v = 2 * M_PI * s / sides;
+                float d = major + minor * std::cos(v);
+                mesh.addVertex(d * std::cos(u), minor * std::sin(v), d * std::sin(u));
+            }
+        }
+        for (int r = 0; r < rings; r++) {
+            for (int s = 0; s < sides; s++) {
+                uint32_t a = r * sides + s;
+                uint32_t b = (r + 1) % rings * sides + s;
+                uint32_t c = (r + 1) % rings * sides + (s + 1) % sides;
+                uint32_t d = r * sides + (s + 1) % sides;
+                mesh.indices.insert(mesh.indices.end(), { a, d, c, a, c, b });
+            }
+        }
+        mesh.computeNormals();
+        return mesh;
+    }
+};
+
+/******************************************************************************/
+/* MeshRenderer                                                               */
+
+// Software rasterizer: vertices are transformed in bulk, triangles are clipped
+// against the near plane, binned into screen tiles and then the tiles are
+// rasterized in parallel with a depth buffer. Shades go through the gray ramp.
+class MeshRenderer : public IntEntity
+{
+public:
+    enum class Mode { Wireframe, Flat, Gouraud };
+    static constexpr int TileSize = 32;
+
+    MeshRenderer(int x, int y, int width, int height, Mesh mesh,
+                 Mode mode = Mode::Gouraud)
+        : IntEntity{x, y}, width{width}, height{height}, mesh{move(mesh)},
+          mode{mode}, colors(width * height), depth(width * height),
+          tilesX{(width + TileSize - 1) / TileSize},
+          tilesY{(height + TileSize - 1) / TileSize},
+          bins(tilesX * tilesY)
+    {
+        // fit the mesh into a unit sphere
+        float radius = 0;
+        for (size_t i = 0; i < this->mesh.vertices(); i++) {
+            radius = std::max(radius, std::sqrt(this->mesh.x[i] * this->mesh.x[i]
+                        + this->mesh.y[i] * this->mesh.y[i]
+                        + this->mesh.z[i] * this->mesh.z[i]));
+        }
+        scale = radius > 0 ? 1 / radius : 1;
+    }
+
+    void update() override
+    {
+        switch (tb->getCurrentKey()) {
+            case 'm':
+                mode = Mode((int(mode) + 1) % 3);
+                break;
+            case ' ':
+                spinning = not spinning;
+                break;
+            default:
+                break;
+        }
+        if (spinning) {
+            angle += 0.02f;
+        }
+        // paused, the picture only changes with the mode or the quality
+        auto next = mode == Mode::Gouraud and quality > 0 ? Mode::Flat : mode;
+        if (not rendered or angle != renderedAngle or next != shown) {
+            render();
+        }
+    }
+
+    // Gouraud shading drops to flat shading under load
+    int qualityLevels() const override
+    {
+        return 2;
+    }
+
+    void setQuality(int level) override
+    {
+        quality = level;
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        if (fresh) {
+            damage.add(Rect{x, y, width, height});
+            fresh = false;
+        }
+    }
+
+    void draw(Display &display) const override
+    {
+        display.blit(x, y, width, height, colors.data(), width);
+    }
+
+private:
+    struct Vertex
+    {
+        float x, y, z, w, shade;
+    };
+
+    struct Triangle
+    {
+        float x[3], y[3], z[3], shade[3];
+        float flat;
+    };
+
+    void render()
+    {
+        shown = mode == Mode::Gouraud and quality > 0 ? Mode::Flat : mode;
+        auto model = Mat4::translation(0, 0, -2.5f) * Mat4::rotationX(0.5f)
+            * Mat4::rotationY(angle)
+            * Mat4{{ scale, 0, 0, 0, 0, scale, 0, 0, 0, 0, scale, 0, 0, 0, 0, 1 }};
+        auto mvp = Mat4::perspective(0.9f, float(width) / height, 0.1f, 10.0f) * model;
+        transformVertices(mvp, Mat4::rotationX(0.5f) * Mat4::rotationY(angle));
+        setupTriangles();
+        threadPool().parallelFor(0, bins.size(), [this](size_t from, size_t to) {
+            for (size_t t = from; t < to; t++) {
+                rasterizeTile(t);
+            }
+        });
+        rendered = fresh = true;
+        renderedAngle = angle;
+    }
+
+    void transformVertices(const Mat4 &mvp, const Mat4 &rotation)
+    {
+        const size_t n = mesh.vertices();
+        for (auto *v : { &clipX, &clipY, &clipZ, &clipW, &normX, &normY, &normZ, &normW }) {
+            v->resize(n);
+        }
+        mvp.transform(mesh.x.data(), mesh.y.data(), mesh.z.data(), n,
+                      clipX.data(), clipY.data(), clipZ.data(), clipW.data());
+        // translation lands in normW and is ignored
+        rotation.transform(mesh.nx.data(), mesh.ny.data(), mesh.nz.data(), n,
+                           normX.data(), normY.data(), normZ.data(), normW.data());
+        shades.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            float d = normX[i] * LightX + normY[i] * LightY + normZ[i] * LightZ;
+            shades[i] = Ambient + (1 - Ambient) * std::max(d, 0.0f);
+        }
+    }
+
+    void setupTriangles()
+    {
+        triangles.clear();
+        for (auto &bin : bins) {
+            bin.clear();
+        }
+        auto &idx = mesh.indices;
+        for (size_t t = 0; t < idx.size(); t += 3) {
+            Vertex in[3], out[4];
+            for (int k = 0; k < 3; k++) {
+                auto i = idx[t + k];
+                in[k] = Vertex{ clipX[i], clipY[i], clipZ[i], clipW[i], shades[i] };
+            }
+            int count = clipNear(in, out);
+            float flat = (in[0].shade + in[1].shade + in[2].shade) / 3;
+            for (int k = 2; k < count; k++) {
+                addTriangle(out[0], out[k - 1], out[k], flat);
+            }
+        }
+    }
+
+    // Sutherland-Hodgman against the near plane (z >= -w), leaves a polygon of
+    // up to four vertices
+    static int clipNear(const Vertex *in, Vertex *out)
+    {
+        int count = 0;
+        for (int k = 0; k < 3; k++) {
+            const Vertex &a = in[k], &b = in[(k + 1) % 3];
+            float da = a.z + a.w, db = b.z + b.w;
+            if (da >= 0) {
+                out[count++] = a;
+            }
+            if ((da >= 0) != (db >= 0)) {
+                float t = da / (da - db);
+                out[count++] = Vertex{ a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+                                       a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t,
+                                       a.shade + (b.shade - a.shade) * t };
+            }
+        }
+        return count;
+    }
+
+    void addTriangle(const Vertex &a, const Vertex &b, const Vertex &c, float flat)
+    {
+        Triangle tri;
+        const Vertex *v[3] = { &a, &b, &c };
+        for (int k = 0; k < 3; k++) {
+            float inv = 1 / v[k]->w;
+            tri.x[k] = (v[k]->x * inv * 0.5f + 0.5f) * width;
+            tri.y[k] = (0.5f - v[k]->y * inv * 0.5f) * height;
+            tri.z[k] = v[k]->z * inv;
+            tri.shade[k] = v[k]->shade;
+        }
+        tri.flat = flat;
+        // y points down on screen, so front faces come out clockwise
+        float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0])
+                   - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+        if (area == 0 or (shown != Mode::Wireframe and area > 0)) {
+            return;
+        }
+
+        float minX = std::min({ tri.x[0], tri.x[1], tri.x[2] });
+        float maxX = std::max({ tri.x[0], tri.x[1], tri.x[2] });
+        float minY = std::min({ tri.y[0], tri.y[1], tri.y[2] });
+        float maxY = std::max({ tri.y[0], tri.y[1], tri.y[2] });
+        if (maxX < 0 or maxY < 0 or minX >= width or minY >= height) {
+            return;
+        }
+        int tx0 = std::max(int(minX) / TileSize, 0);
+        int tx1 = std::min(int(maxX) / TileSize, tilesX - 1);
+        int ty0 = std::max(int(minY) / TileSize, 0);
+        int ty1 = std::min(int(maxY) / TileSize, tilesY - 1);
+        uint32_t index = triangles.size();
+        triangles.push_back(tri);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            for (int tx = tx0; tx <= tx1; tx++) {
+                bins[ty * tilesX + tx].push_back(index);
+            }
+        }
+    }
+
+    void rasterizeTile(size_t tile)
+    {
+        Rect area = Rect{ int(tile % tilesX) * TileSize, int(tile / tilesX) * TileSize,
+                          TileSize, TileSize }.intersected(Rect{0, 0, width, height});
+        for (int row = area.y; row < area.bottom(); row++) {
+            std::fill_n(&colors[row * width + area.x], area.w, Color::Default);
+            std::fill_n(&depth[row * width + area.x], area.w, 1.0f);
+        }
+        for (auto t : bins[tile]) {
+            if (shown == Mode::Wireframe) {
+                auto &tri = triangles[t];
+                for (int k = 0; k < 3; k++) {
+                    line(area, tri.x[k], tri.y[k], tri.x[(k + 1) % 3], tri.y[(k + 1) % 3]);
+                }
+            } else {
+                fill(area, triangles[t]);
+            }
+        }
+    }
+
+    void fill(const Rect &area, const Triangle &tri)
+    {
+        int x0 = std::max(area.x, int(std::floor(std::min({ tri.x[0], tri.x[1], tri.x[2] }))));
+        int x1 = std::min(area.right() - 1, int(std::ceil(std::max({ tri.x[0], tri.x[1], tri.x[2] }))));
+        int y0 = std::max(area.y, int(std::floor(std::min({ tri.y[0], tri.y[1], tri.y[2] }))));
+        int y1 = std::min(area.bottom() - 1, int(std::ceil(std::max({ tri.y[0], tri.y[1], tri.y[2] }))));
+        if (x0 > x1 or y0 > y1) {
+            return;
+        }
+
+        // edge k is opposite to vertex k, e_k(x, y) = a_k * x + b_k * y + c_k
+        float a[3], b[3], c[3];
+        for (int k = 0; k < 3; k++) {
+            int i = (k + 1) % 3, j = (k + 2) % 3;
+            a[k] = tri.y[i] - tri.y[j];
+            b[k] = tri.x[j] - tri.x[i];
+            c[k] = tri.x[i] * tri.y[j] - tri.x[j] * tri.y[i];
+        }
+        float area2 = c[0] + c[1] + c[2];
+        if (area2 == 0) {
+            return;
+        }
+        float inv = 1 / area2;
+
+        for (int py = y0; py <= y1; py++) {
+            float fy = py + 0.5f, fx = x0 + 0.5f;
+            float e[3];
+            for (int k = 0; k < 3; k++) {
+                e[k] = (a[k] * fx + b[k] * fy + c[k]) * inv;
+            }
+            for (int px = x0; px <= x1; px++) {
+                if (e[0] >= 0 and e[1] >= 0 and e[2] >= 0) {
+                    float z = e[0] * tri.z[0] + e[1] * tri.z[1] + e[2] * tri.z[2];
+                    auto i = py * width + px;
+                    if (z < depth[i]) {
+                        depth[i] = z;
+                        float shade = shown == Mode::Flat ? tri.flat
+                            : e[0] * tri.shade[0] + e[1] * tri.shade[1] + e[2] * tri.shade[2];
+                        colors[i] = toRamp(shade);
+                    }
+                }
+                for (int k = 0; k < 3; k++) {
+                    e[k] += a[k] * inv;
+                }
+            }
+        }
+    }
+
+    // Bresenham, clipped to the tile
+    void line(const Rect &area, float fx0, float fy0, float fx1, float fy1)
+    {
+        int x0 = fx0, y0 = fy0, x1 = fx1, y1 = fy1;
+        int dx = std::abs(x1 - x0), dy = -std::abs(y1 - y0);
+        int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+        for (int err = dx + dy;;) {
+            if (x0 >= area.x and x0 < area.right() and y0 >= area.y and y0 < area.bottom()) {
+                colors[y0 * width + x0] = Color::makeSOG(23);
+            }
+            if (x0 == x1 and y0 == y1) {
+                break;
+            }
+            int e2 = 2 * err;
+            if (e2 >= dy) {
+                err += dy;
+                x0 += sx;
+            }
+            if (e2 <= dx) {
+                err += dx;
+                y0 += sy;
+            }
+        }
+    }
+
+    static Color toRamp(float shade)
+    {
+        return Color::makeSOG(unsigned(std::min(std::max(shade, 0.0f), 1.0f) * 23));
+    }
+
+private:
+    static constexpr float LightX = 0.0f;
+    static constexpr float LightY = 0.6f;
+    static constexpr float LightZ = 0.8f;
+    static constexpr float Ambient = 0.15f;
+
+    int width, height;
+    Mesh mesh;
+    Mode mode;
+    Mode shown;
+    int quality = 0;
+    float scale;
+    float angle = 0.0f;
+    bool spinning = true;
+    // what colors hold, and whether they changed since the last damage
+    bool rendered = false;
+    bool fresh = false;
+    float renderedAngle = 0.0f;
+
+    vector<float> clipX, clipY, clipZ, clipW;
+    vector<float> normX, normY, normZ, normW;
+    vector<float> shades;
+    vector<Triangle> triangles;
+
+    vector<Color> colors;
+    vector<float> depth;
+    int tilesX, tilesY;
+    vector<vector<uint32_t> > bins;
+};
+
+/******************************************************************************/
+/* Raycaster                                                                  */
+
+// First person view of a grid map. Every screen column is an independent DDA
+// walk through the grid, so the columns are spread over the thread pool. Wall
+// textures are stored column by column, which makes drawing a wall slice a
+// walk down one contiguous strip.
+class Raycaster : public IntEntity
+{
+public:
+    static constexpr int TextureSize = 32;
+
+    Raycaster(int x, int y, int width, int height, vector<string> map)
+        : IntEntity{x, y}, width{width}, height{height}, map{move(map)},
+          columns(width * height), rows(width * height)
+    {
+        makeTextures();
+    }
+
+    void update() override
+    {
+        switch (tb->getCurrentKey()) {
+            case 'w': walk(+0.2); break;
+            case 's': walk(-0.2); break;
+            case 'a': turn(-0.1); break;
+            case 'd': turn(+0.1); break;
+            case 'c': columnMajor = not columnMajor; break;
+            default: break;
+        }
+        turn(0.005);
+        auto start = std::chrono::steady_clock::now();
+        threadPool().parallelFor(0, width, [this](size_t from, size_t to) {
+            for (size_t col = from; col < to; col++) {
+                castColumn(col);
+            }
+        });
+        if (columnMajor) {
+            transpose();
+        }
+        renderTime += std::chrono::steady_clock::now() - start;
+        if (++frames == 100) {
+            tb->log(columnMajor ? "column-major" : "row-major", " raycast: ",
+                    std::chrono::duration<double, std::milli>(renderTime).count() / frames,
+                    "ms/frame", endl);
+            frames = 0;
+            renderTime = {};
+        }
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        damage.add(Rect{x, y, width, height});
+    }
+
+    void draw(Display &display) const override
+    {
+        display.blit(x, y, width, height, rows.data(), width);
+    }
+
+private:
+    bool isWall(int mx, int my) const
+    {
+        return my < 0 or my >= int(map.size()) or mx < 0 or mx >= int(map[my].size())
+            or map[my][mx] != ' ';
+    }
+
+    void walk(double step)
+    {
+        double nx = posX + dirX * step, ny = posY + dirY * step;
+        if (not isWall(int(nx), int(posY))) {
+            posX = nx;
+        }
+        if (not isWall(int(posX), int(ny))) {
+            posY = ny;
+        }
+    }
+
+    void turn(double a)
+    {
+        double c = std::cos(a), s = std::sin(a);
+        double dx = dirX * c - dirY * s, px = planeX * c - planeY * s;
+        dirY = dirX * s + dirY * c;
+        dirX = dx;
+        planeY = planeX * s + planeY * c;
+        planeX = px;
+    }
+
+    void castColumn(int col)
+    {
+        double cameraX = 2.0 * col / width - 1;
+        double rayX = dirX + planeX * cameraX, rayY = dirY + planeY * cameraX;
+        int mx = int(posX), my = int(posY);
+        double deltaX = rayX == 0 ? 1e30 : std::abs(1 / rayX);
+        double deltaY = rayY == 0 ? 1e30 : std::abs(1 / rayY);
+        int stepX = rayX < 0 ? -1 : 1, stepY = rayY < 0 ? -1 : 1;
+        double sideX = (rayX < 0 ? posX - mx : mx + 1 - posX) * deltaX;
+        double sideY = (rayY < 0 ? posY - my : my + 1 - posY) * deltaY;
+
+        bool ySide = false;
+        for (int steps = 0; steps < MaxSteps; steps++) {
+            if (sideX < sideY) {
+                sideX += deltaX;
+                mx += stepX;
+                ySide = false;
+            } else {
+                sideY += deltaY;
+                my += stepY;
+                ySide = true;
+            }
+            if (isWall(mx, my)) {
+                break;
+            }
+        }
+        double dist = ySide ? sideY - deltaY : sideX - deltaX;
+        dist = std::max(dist, 1e-3);
+
+        double hit = ySide ? posX + dist * rayX : posY + dist * rayY;
+        int u = int((hit - std::floor(hit)) * TextureSize);
+        int type = isWall(mx, my) and my >= 0 and my < int(map.size())
+                   and mx >= 0 and mx < int(map[my].size()) ? map[my][mx] % Textures : 0;
+        const Color *strip = &textures[(type * TextureSize + u) * TextureSize];
+
+        int lineHeight = int(height / dist);
+        int top = (height - lineHeight) / 2, bottom = top + lineHeight;
+        double shade = std::min(1.0, 3.0 / dist) * (ySide ? 0.7 : 1.0);
+
+        // column-major writes are contiguous, row-major ones are `width` apart
+        Color *out = columnMajor ? &columns[col * height] : &rows[col];
+        size_t stride = columnMajor ? 1 : width;
+        for (int row = 0; row < height; row++) {
+            Color c;
+            if (row < top) {
+                c = Ceiling;
+            } else if (row >= bottom) {
+                c = Floor;
+            } else {
+                int v = (row - top) * TextureSize / lineHeight;
+                c = strip[v] * shade;
+            }
+            out[row * stride] = c;
+        }
+    }
+
+    // Copies the column-major buffer into row-major order in small blocks so
+    // both sides stay in cache
+    void transpose()
+    {
+        constexpr int Block = 16;
+        for (int by = 0; by < height; by += Block) {
+            for (int bx = 0; bx < width; bx += Block) {
+                int ey = std::min(by + Block, height), ex = std::min(bx + Block, width);
+                for (int col = bx; col < ex; col++) {
+                    for (int row = by; row < ey; row++) {
+                        rows[row * width + col] = columns[col * height + row];
+                    }
+                }
+            }
+        }
+    }
+
+    void makeTextures()
+    {
+        textures.resize(Textures * TextureSize * TextureSize);
+        for (int t = 0; t < Textures; t++) {
+            for (int u = 0; u < TextureSize; u++) {
+                for (int v = 0; v < TextureSize; v++) {
+                    unsigned level;
+                    if (t % 2 == 0) {
+                        // bricks
+                        int row = v / 8, off = row % 2 ? 8 : 0;
+                        bool mortar = v % 8 == 0 or (u + off) % 16 == 0;
+                        level = mortar ? 6 : 18 + (u * 7 + v * 3) % 5;
+                    } else {
+                        // panels
+                        bool edge = u % 16 < 2 or v % 16 < 2;
+                        level = edge ? 10 : 16 + (u ^ v) % 4;
+                    }
+                    textures[(t * TextureSize + u) * TextureSize + v] = Color::makeSOG(level);
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr int MaxSteps = 256;
+    static constexpr int Textures = 4;
+    static constexpr Color Ceiling = Color{0, 0, 64};
+    static constexpr Color Floor = Color{64, 64, 0};
+
+    int width, height;
+    vector<string> map;
+    double posX = 1.5, posY = 1.5;
+    double dirX = 1, dirY = 0;
+    double planeX = 0, planeY = 0.66;
+    bool columnMajor = true;
+
+    vector<Color> textures;
+    vector<Color> columns;
+    vector<Color> rows;
+
+    int frames = 0;
+    std::chrono::steady_clock::duration renderTime{};
+};
+
+/******************************************************************************/
+/* TileMap                                                                    */
+
+// A large map of tile ids, where every tile is a small pixel pattern. Tiles are
+// stored in chunks; a chunk holding a single tile id everywhere keeps just
+// that id, so huge uniform areas cost nothing. Visible chunks are rendered
+// once into a bounded LRU pixel cache and drawing is then a blit per chunk.
+class TileMap : public IntEntity
+{
+public:
+    using TileId = uint16_t;
+    static constexpr int TileSize = 8;
+    static constexpr int ChunkTiles = 32;
+    static constexpr int ChunkPixels = ChunkTiles * TileSize;
+    static constexpr size_t MaxCachedChunks = 64;
+
+    TileMap(int x, int y, int width, int height, int mapWidth, int mapHeight)
+        : IntEntity{x, y}, width{width}, height{height},
+          chunksX{(mapWidth + ChunkTiles - 1) / ChunkTiles},
+          chunksY{(mapHeight + ChunkTiles - 1) / ChunkTiles},
+          chunks(chunksX * chunksY) {}
+
+    // Tile patterns are TileSize x TileSize colors, row by row
+    TileId addTile(vector<Color> pattern)
+    {
+        pattern.resize(TileSize * TileSize);
+        patterns.push_back(move(pattern));
+        return patterns.size() - 1;
+    }
+
+    TileId getTile(int tx, int ty) const
+    {
+        auto &chunk = chunks[chunkIndex(tx, ty)];
+        if (chunk.tiles.empty()) {
+            return chunk.fill;
+        }
+        return chunk.tiles[(ty % ChunkTiles) * ChunkTiles + tx % ChunkTiles];
+    }
+
+    void setTile(int tx, int ty, TileId id)
+    {
+        if (tx < 0 or ty < 0 or tx >= chunksX * ChunkTiles or ty >= chunksY * ChunkTiles) {
+            return;
+        }
+        auto index = chunkIndex(tx, ty);
+        auto &chunk = chunks[index];
+        if (chunk.tiles.empty()) {
+            if (chunk.fill == id) {
+                return;
+            }
+            chunk.tiles.assign(ChunkTiles * ChunkTiles, chunk.fill);
+        }
+        chunk.tiles[(ty % ChunkTiles) * ChunkTiles + tx % ChunkTiles] = id;
+        invalidate(index);
+    }
+
+    // Fills a whole chunk with one tile, dropping its per-tile storage
+    void fillChunk(int cx, int cy, TileId id)
+    {
+        auto index = cy * chunksX + cx;
+        chunks[index].tiles.clear();
+        chunks[index].tiles.shrink_to_fit();
+        chunks[index].fill = id;
+        invalidate(index);
+    }
+
+    void scroll(int dx, int dy)
+    {
+        // a map smaller than the view stays at the top left
+        cameraX = std::clamp(cameraX + dx, 0, std::max(chunksX * ChunkPixels - width, 0));
+        cameraY = std::clamp(cameraY + dy, 0, std::max(chunksY * ChunkPixels - height, 0));
+        changed = true;
+    }
+
+    void update() override
+    {
+        switch (tb->getCurrentKey()) {
+            case TB_KEY_ARROW_LEFT:  scroll(-TileSize, 0); break;
+            case TB_KEY_ARROW_RIGHT: scroll(+TileSize, 0); break;
+            case TB_KEY_ARROW_UP:    scroll(0, -TileSize); break;
+            case TB_KEY_ARROW_DOWN:  scroll(0, +TileSize); break;
+            case ' ': {
+                int tx = (cameraX + width / 2) / TileSize;
+                int ty = (cameraY + height / 2) / TileSize;
+                setTile(tx, ty, (getTile(tx, ty) + 1) % patterns.size());
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        if (changed) {
+            damage.add(Rect{x, y, width, height});
+            changed = false;
+        }
+    }
+
+    void draw(Display &display) const override
+    {
+        auto area = display.getClip().intersected(Rect{x, y, width, height});
+        if (area.empty()) {
+            return;
+        }
+        frame++;
+        // area in map pixels
+        int left = cameraX + area.x - x, top = cameraY + area.y - y;
+        int right = left + area.w, bottom = top + area.h;
+        for (int cy = top / ChunkPixels; cy * ChunkPixels < bottom and cy < chunksY; cy++) {
+            for (int cx = left / ChunkPixels; cx * ChunkPixels < right and cx < chunksX; cx++) {
+                auto &pixels = renderChunk(cy * chunksX + cx);
+                int px = cx * ChunkPixels, py = cy * ChunkPixels;
+                int l = std::max(px, left), t = std::max(py, top);
+                int r = std::min(px + ChunkPixels, right);
+                int b = std::min(py + ChunkPixels, bottom);
+                display.blit(x + l - cameraX, y + t - cameraY, r - l, b - t,
+                             &pixels[(t - py) * ChunkPixels + (l - px)], ChunkPixels);
+            }
+        }
+        evict();
+    }
+
+    size_t cachedChunks() const noexcept
+    {
+        return cache.size();
+    }
+
+private:
+    struct Chunk
+    {
+        vector<TileId> tiles;
+        TileId fill = 0;
+    };
+
+    struct CachedChunk
+    {
+        vector<Color> pixels;
+        uint64_t lastUsed = 0;
+    };
+
+    size_t chunkIndex(int tx, int ty) const noexcept
+    {
+        return (ty / ChunkTiles) * chunksX + tx / ChunkTiles;
+    }
+
+    void invalidate(size_t chunk)
+    {
+        cache.erase(chunk);
+        changed = true;
+    }
+
+    const vector<Color> &renderChunk(size_t index) const
+    {
+        auto &cached = cache[index];
+        cached.lastUsed = frame;
+        if (not cached.pixels.empty()) {
+            return cached.pixels;
+        }
+        cached.pixels.resize(ChunkPixels * ChunkPixels);
+        auto &chunk = chunks[index];
+        for (int ty = 0; ty < ChunkTiles; ty++) {
+            for (int tx = 0; tx < ChunkTiles; tx++) {
+                TileId id = chunk.tiles.empty() ? chunk.fill
+                                                : chunk.tiles[ty * ChunkTiles + tx];
+                const Color *src = &patterns[id % patterns.size()][0];
+                Color *dst = &cached.pixels[ty * TileSize * ChunkPixels + tx * TileSize];
+                for (int row = 0; row < TileSize; row++) {
+                    std::copy(src + row * TileSize, src + (row + 1) * TileSize,
+                              dst + row * ChunkPixels);
+                }
+            }
+        }
+        return cached.pixels;
+    }
+
+    void evict() const
+    {
+        while (cache.size() > MaxCachedChunks) {
+            auto oldest = cache.begin();
+            for (auto it = cache.begin(); it != cache.end(); ++it) {
+                if (it->second.lastUsed < oldest->second.lastUsed) {
+                    oldest = it;
+                }
+            }
+            cache.erase(oldest);
+        }
+    }
+
+private:
+    int width, height;
+    int chunksX, chunksY;
+    vector<Chunk> chunks;
+    vector<vector<Color> > patterns = { vector<Color>(TileSize * TileSize) };
+    int cameraX = 0, cameraY = 0;
+    bool changed = true;
+
+    // rendering only fills the cache, so it can happen from draw()
+    mutable std::unordered_map<size_t, CachedChunk> cache;
+    mutable uint64_t frame = 0;
+};
+
+/******************************************************************************/
+/* Canvas                                                                     */
+
+// A round brush as one span per row, cached per radius
+struct BrushMask
+{
+    struct Span
+    {
+        int dy, x0, x1;     // relative to the center, x1 inclusive
+    };
+    int radius;
+    vector<Span> spans;
+
+    static const BrushMask &get(int radius)
+    {
+        static std::map<int, uptr<BrushMask>> cache;
+        auto &mask = cache[radius];
+        if (not mask) {
+            mask = make_unique<BrushMask>();
+            mask->radius = radius;
+            for (int dy = -radius; dy <= radius; dy++) {
+                int half = 0;
+                while ((half + 1) * (half + 1) + dy * dy <= radius * radius) {
+                    half++;
+                }
+                mask->spans.push_back(Span{dy, -half, half});
+            }
+        }
+        return *mask;
+    }
+};
+
+// Persistent paint layer. Mouse drags are joined into line segments along
+// which the brush is stamped, spaced so its discs overlap and fast drags leave
+// no gaps; only what was painted gets damaged.
+//
+// Pixels live in reference counted tiles that are copied before being written
+// while shared. Untouched tiles all share one blank tile, and every edit keeps
+// the tiles it replaced, so undo and redo swap just those back and the history
+// costs memory in proportion to the painted area.
+//
+// Zoomed out, the canvas is drawn from a pyramid of box filtered levels at
+// half, quarter, ... size. Levels are made of blocks built the first time they
+// are in view and dropped again where the canvas changes.
+//
+// Once more tiles are unpacked than the memory limit allows, those that have
+// not been drawn or painted for longest are run length packed after the next
+// frame, and unpacked again when they are drawn or painted. Reads that only
+// scan, for the pyramid or a fill, leave packed tiles packed.
+class Canvas : public IntEntity
+{
+public:
+    static constexpr int TileSize = 32;
+
+    struct Tile
+    {
+        vector<Color> pixels;       // empty while packed
+        vector<uint8_t> packed;
+        uint32_t used = 0;          // frame it was last drawn or written in
+        bool incompressible = false;    // not tried again until written
+    };
+    using TilePtr = std::shared_ptr<Tile>;
+
+    Canvas(int x, int y, int width, int height)
+        : IntEntity{x, y}, width{width}, height{height},
+          tilesX{(width + TileSize - 1) / TileSize},
+          tiles(size_t(tilesX) * ((height + TileSize - 1) / TileSize), blankTile()),
+          touched(tiles.size(), 0) {}
+
+    void setBrush(int radius, Color color)
+    {
+        brushRadius = std::clamp(radius, 0, MaxBrush);
+        brushColor = color;
+    }
+
+    int getBrushRadius() const noexcept
+    {
+        return brushRadius;
+    }
+
+    // Shows the canvas scaled down by 2^level, keeping what is in the top
+    // left corner of the view there
+    void setZoom(int level)
+    {
+        level = std::clamp(level, 0, MaxZoom);
+        x = -((-x << zoom) >> level);
+        y = -((-y << zoom) >> level);
+        zoom = level;
+        scroll(0, 0);
+    }
+
+    int getZoom() const noexcept
+    {
+        return zoom;
+    }
+
+    // Moves the view over the canvas, in pixels of the current zoom
+    void scroll(int dx, int dy)
+    {
+        x = std::clamp(x - dx, 1 - view().w, 0);
+        y = std::clamp(y - dy, 1 - view().h, 0);
+    }
+
+    // Bytes of unpacked tiles kept before the coldest get packed
+    void setMemoryLimit(size_t bytes)
+    {
+        memoryLimit = bytes;
+    }
+
+    bool wantsUpdate() const override
+    {
+        return false;
+    }
+
+    bool wantsMouse() const override
+    {
+        return true;
+    }
+
+    // Left paints, right erases, middle fills, the wheel resizes the brush.
+    // Every stroke is one step of the history.
+    void onMouse(const MouseEvent &event) override
+    {
+        int px = (event.x - x) << zoom, py = (event.y - y) << zoom;
+        switch (event.key) {
+            case TB_KEY_MOUSE_LEFT:
+            case TB_KEY_MOUSE_RIGHT: {
+                auto color = event.key == TB_KEY_MOUSE_LEFT ? brushColor : Color::Default;
+                if (stroking) {
+                    line(lastX, lastY, px, py, color);
+                } else {
+                    stamp(px, py, color);
+                }
+                stroking = true;
+                lastX = px;
+                lastY = py;
+                break;
+            }
+            case TB_KEY_MOUSE_MIDDLE:
+                // held, the press repeats; fill once and leave strokes alone
+                if (not filling) {
+                    fill(px, py, brushColor);
+                }
+                filling = true;
+                break;
+            case TB_KEY_MOUSE_RELEASE:
+                stroking = false;
+                filling = false;
+                commit();
+                break;
+            case TB_KEY_MOUSE_WHEEL_UP:
+                setBrush(brushRadius + 1, brushColor);
+                break;
+            case TB_KEY_MOUSE_WHEEL_DOWN:
+                setBrush(brushRadius - 1, brushColor);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void line(int x0, int y0, int x1, int y1, Color color)
+    {
+        // stamps at most half a brush apart
+        int steps = std::max(std::abs(x1 - x0), std::abs(y1 - y0));
+        int spacing = std::max(1, brushRadius / 2);
+        int count = std::max(1, (steps + spacing - 1) / spacing);
+        for (int i = 1; i <= count; i++) {
+            stamp(x0 + (x1 - x0) * i / count, y0 + (y1 - y0) * i / count, color);
+        }
+    }
+
+    void stamp(int cx, int cy, Color color)
+    {
+        auto &mask = BrushMask::get(brushRadius);
+        for (auto &span : mask.spans) {
+            int row = cy + span.dy;
+            if (row < 0 or row >= height) {
+                continue;
+            }
+            int from = std::max(0, cx + span.x0), to = std::min(width - 1, cx + span.x1);
+            if (from <= to) {
+                fillRow(row, from, to, color, current);
+            }
+        }
+        int r = brushRadius;
+        changed(Rect{cx - r, cy - r, 2 * r + 1, 2 * r + 1}
+                .intersected(Rect{0, 0, width, height}));
+    }
+
+    // Bucket fill of the area connected to (px, py) that has its color. Big
+    // canvases are split into bands of rows filled in parallel.
+    void fill(int px, int py, Color color)
+    {
+        if (px < 0 or py < 0 or px >= width or py >= height) {
+            return;
+        }
+        // read through a scratch buffer, a packed seed tile stays packed
+        vector<Color> scratch;
+        auto target = pixelsOf(tiles[(py / TileSize) * tilesX + px / TileSize], scratch)
+                [(py % TileSize) * TileSize + px % TileSize];
+        if (target == color) {
+            return;
+        }
+        if (size_t(width) * height < ParallelFillArea or threadPool().size() == 1) {
+            FillBand band{0, height};
+            band.seeds.push_back(Span{py, px, px});
+            fillBand(band, target, color, current);
+            for (auto &r : band.damage) {
+                changed(r);
+            }
+            return;
+        }
+
+        // spans leaving a band become seeds of its neighbour in the next
+        // round, so every band only ever touches its own rows and tiles
+        vector<FillBand> bands;
+        for (int top = 0; top < height; top += BandRows) {
+            bands.emplace_back(top, std::min(height, top + BandRows));
+        }
+        bands[py / BandRows].seeds.push_back(Span{py, px, px});
+        vector<FillBand *> active;
+        for (;;) {
+            active.clear();
+            for (auto &band : bands) {
+                if (not band.seeds.empty()) {
+                    active.push_back(&band);
+                }
+            }
+            if (active.empty()) {
+                break;
+            }
+            threadPool().parallelFor(0, active.size(), [&](size_t from, size_t to) {
+                for (size_t i = from; i < to; i++) {
+                    fillBand(*active[i], target, color, active[i]->changes);
+                }
+            });
+            for (auto *band : active) {
+                auto index = band - bands.data();
+                if (index > 0) {
+                    append(bands[index - 1].seeds, band->up);
+                }
+                if (index + 1 < ptrdiff_t(bands.size())) {
+                    append(bands[index + 1].seeds, band->down);
+                }
+                band->up.clear();
+                band->down.clear();
+            }
+        }
+        for (auto &band : bands) {
+            current.insert(current.end(), band.changes.begin(), band.changes.end());
+            for (auto &r : band.damage) {
+                changed(r);
+            }
+        }
+    }
+
+    // Closes the current history step, if anything was painted since the last
+    void commit()
+    {
+        if (current.empty()) {
+            return;
+        }
+        undoStack.push_back(move(current));
+        current.clear();
+        if (undoStack.size() > MaxHistory) {
+            undoStack.erase(undoStack.begin());
+        }
+        redoStack.clear();
+        serial++;
+    }
+
+    bool undo()
+    {
+        commit();
+        if (undoStack.empty()) {
+            return false;
+        }
+        swapTiles(undoStack.back());
+        redoStack.push_back(move(undoStack.back()));
+        undoStack.pop_back();
+        return true;
+    }
+
+    bool redo()
+    {
+        commit();
+        if (redoStack.empty()) {
+            return false;
+        }
+        swapTiles(redoStack.back());
+        undoStack.push_back(move(redoStack.back()));
+        redoStack.pop_back();
+        return true;
+    }
+
+    const Color &getPixel(int px, int py) const
+    {
+        return load(tiles[(py / TileSize) * tilesX + px / TileSize])
+            .pixels[(py % TileSize) * TileSize + px % TileSize];
+    }
+
+    bool getBounds(Rect &bounds) const override
+    {
+        bounds = view();
+        return true;
+    }
+
+    void collectDamage(Damage &damage) override
+    {
+        if (shown != view()) {
+            damage.add(shown);
+            damage.add(view());
+        }
+        for (auto &r : dirty.getRects()) {
+            auto scaled = shrink(r, zoom);
+            damage.add(Rect{x + scaled.x, y + scaled.y, scaled.w, scaled.h});
+        }
+        dirty.clear();
+    }
+
+    void draw(Display &display) const override
+    {
+        frame++;
+        drawTiles(display);
+        evict();
+    }
+
+private:
+    static constexpr int MaxBrush = 32;
+    static constexpr int MaxZoom = 6;
+    static constexpr int BandRows = 64;
+    static constexpr int DamageRows = 16;
+    static constexpr size_t ParallelFillArea = 1 << 20;
+    static constexpr size_t MaxHistory = 256;
+    static constexpr size_t TileBytes = TileSize * TileSize * sizeof(Color);
+    static_assert(BandRows % TileSize == 0, "bands must not share tiles");
+
+    void drawTiles(Display &display) const
+    {
+        shown = view();
+        auto area = display.getClip().intersected(shown);
+        if (area.empty()) {
+            return;
+        }
+        Rect local{area.x - x, area.y - y, area.w, area.h};
+        if (zoom > 0) {
+            addLevels(zoom);
+            for (int by = local.y / MipBlockSize; by <= (local.bottom() - 1) / MipBlockSize; by++) {
+                for (int bx = local.x / MipBlockSize; bx <= (local.right() - 1) / MipBlockSize; bx++) {
+                    auto r = local.intersected(Rect{bx * MipBlockSize, by * MipBlockSize,
+                                                    MipBlockSize, MipBlockSize});
+                    auto &block = mipBlock(zoom - 1, bx, by);
+                    display.blit(x + r.x, y + r.y, r.w, r.h,
+                                 &block.colors[(r.y % MipBlockSize) * MipBlockSize
+                                               + r.x % MipBlockSize],
+                                 MipBlockSize);
+                }
+            }
+            return;
+        }
+        for (int ty = local.y / TileSize; ty <= (local.bottom() - 1) / TileSize; ty++) {
+            for (int tx = local.x / TileSize; tx <= (local.right() - 1) / TileSize; tx++) {
+                auto r = local.intersected(
+                        Rect{tx * TileSize, ty * TileSize, TileSize, TileSize});
+                auto &tile = load(tiles[ty * tilesX + tx]);
+                tile.used = frame;
+                display.blit(x + r.x, y + r.y, r.w, r.h,
+                             &tile.pixels[(r.y % TileSize) * TileSize + r.x % TileSize],
+                             TileSize);
+            }
+        }
+    }
+
+    // A tile as it was before an edit, or after it once undone
+    struct TileChange
+    {
+        size_t index;
+        TilePtr tile;
+    };
+    using Edit = vector<TileChange>;
+
+    // Row y from x0 to x1 inclusive
+    struct Span
+    {
+        int y, x0, x1;
+    };
+
+    struct FillBand
+    {
+        FillBand(int top, int bottom) : top{top}, bottom{bottom} {}
+
+        int top, bottom;
+        vector<Span> seeds, up, down;
+        vector<Rect> damage;    // bounding box every DamageRows rows
+        Edit changes;
+        // whether packed tiles have the target color anywhere
+        std::unordered_map<const Tile *, bool> packedHasTarget;
+    };
+
+    static TilePtr blankTile()
+    {
+        static auto blank = [] {
+            auto tile = std::make_shared<Tile>();
+            tile->pixels.assign(TileSize * TileSize, Color::Default);
+            return tile;
+        }();
+        return blank;
+    }
+
+    static void append(vector<Span> &to, const vector<Span> &from)
+    {
+        to.insert(to.end(), from.begin(), from.end());
+    }
+
+    // A square of a pyramid level, its colors in RGBA premultiplied by how
+    // much of the area is painted, and as the palette colors that get drawn
+    static constexpr int MipBlockShift = 5;
+    static constexpr int MipBlockSize = 1 << MipBlockShift;
+
+    struct MipBlock
+    {
+        std::array<uint32_t, MipBlockSize * MipBlockSize> rgba;
+        std::array<Color, MipBlockSize * MipBlockSize> colors;
+    };
+    using MipBlockPtr = std::shared_ptr<const MipBlock>;
+
+    struct MipLevel
+    {
+        int width, height;
+        int blocksX, blocksY;
+        vector<MipBlockPtr> blocks;     // empty until in view, or after a change
+    };
+
+    static uint32_t toRgba(Color c)
+    {
+        if (c == Color::Default) {
+            return 0;
+        }
+        auto rgb = c.toRgb();
+        return rgb.r | rgb.g << 8 | rgb.b << 16 | 0xffu << 24;
+    }
+
+    // Mostly unpainted areas stay unpainted
+    static Color fromRgba(uint32_t p)
+    {
+        unsigned a = p >> 24;
+        if (a < 128) {
+            return Color::Default;
+        }
+        auto channel = [&](int shift) { return uint8_t(((p >> shift) & 0xff) * 255 / a); };
+        return Color::fromRgb(Rgb{channel(0), channel(8), channel(16)});
+    }
+
+    // Region r of a level seen one level further down, rounded outwards
+    static Rect shrink(const Rect &r, int levels)
+    {
+        int l = r.x >> levels, t = r.y >> levels;
+        int w = ((r.right() - 1) >> levels) - l + 1, h = ((r.bottom() - 1) >> levels) - t + 1;
+        return Rect{l, t, w, h};
+    }
+
+    // Averages 2x2 blocks of the two rows into count pixels. Four source
+    // pixels are one 16 byte vector, summed in 16 bit lanes; with SSE2 or NEON
+    // enabled each step is a handful of instructions.
+    static void boxFilter(const uint32_t *top, const uint32_t *bottom, uint32_t *out,
+                          int count)
+    {
+        using Bytes = uint8_t __attribute__((vector_size(16)));
+        using Sums = uint16_t __attribute__((vector_size(32)));
+        using Pairs = uint16_t __attribute__((vector_size(16)));
+        using Averages = uint8_t __attribute__((vector_size(8)));
+        int i = 0;
+        for (; i + 2 <= count; i += 2) {
+            Bytes t, b;
+            std::memcpy(&t, top + 2 * i, sizeof(t));
+            std::memcpy(&b, bottom + 2 * i, sizeof(b));
+            Sums rows = __builtin_convertvector(t, Sums) + __builtin_convertvector(b, Sums);
+            Pairs sums = __builtin_shufflevector(rows, rows, 0, 1, 2, 3, 8, 9, 10, 11)
+                       + __builtin_shufflevector(rows, rows, 4, 5, 6, 7, 12, 13, 14, 15);
+            Averages avg = __builtin_convertvector((sums + uint16_t(2)) >> uint16_t(2), Averages);
+            std::memcpy(out + i, &avg, sizeof(avg));
+        }
+        for (; i < count; i++) {
+            uint32_t p = 0;
+            for (int shift = 0; shift < 32; shift += 8) {
+                unsigned sum = (top[2 * i] >> shift & 0xff) + (top[2 * i + 1] >> shift & 0xff)
+                             + (bottom[2 * i] >> shift & 0xff)
+                             + (bottom[2 * i + 1] >> shift & 0xff);
+                p |= (sum + 2) / 4 << shift;
+            }
+            out[i] = p;
+        }
+    }
+
+    static MipBlockPtr blankMipBlock()
+    {
+        static auto blank = [] {
+            auto block = std::make_shared<MipBlock>();
+            block->rgba.fill(0);
+            block->colors.fill(Color::Default);
+            return block;
+        }();
+        return blank;
+    }
+
+    // Block (bx, by) of level k, built from the four blocks of the level above
+    // it, or the four canvas tiles, when it's first needed
+    const MipBlock &mipBlock(size_t k, int bx, int by) const
+    {
+        auto &level = levels[k];
+        auto &block = level.blocks[size_t(by) * level.blocksX + bx];
+        if (not block) {
+            block = buildMipBlock(k, bx, by);
+        }
+        return *block;
+    }
+
+    MipBlockPtr buildMipBlock(size_t k, int bx, int by) const
+    {
+        int srcWidth = k ? levels[k - 1].width : width;
+        int srcHeight = k ? levels[k - 1].height : height;
+        int srcBlocksX = k ? levels[k - 1].blocksX : tilesX;
+        int srcBlocksY = k ? levels[k - 1].blocksY : int(tiles.size()) / tilesX;
+        static_assert(MipBlockSize == TileSize, "blocks and tiles line up");
+
+        // the sources, blank ones are left alone
+        const Color *tilePixels[4] = {};
+        const MipBlock *blocks[4] = {};
+        bool blank = true;
+        for (int i = 0; i < 4; i++) {
+            int sx = bx * 2 + i % 2, sy = by * 2 + i / 2;
+            if (sx >= srcBlocksX or sy >= srcBlocksY) {
+                continue;
+            }
+            if (k == 0) {
+                auto &tile = tiles[size_t(sy) * tilesX + sx];
+                if (tile != blankTile()) {
+                    tilePixels[i] = pixelsOf(tile, decoded[i]);
+                    blank = false;
+                }
+            } else {
+                auto &source = mipBlock(k - 1, sx, sy);
+                blocks[i] = &source;
+                blank = blank and &source == blankMipBlock().get();
+            }
+        }
+        if (blank) {
+            return blankMipBlock();
+        }
+
+        auto block = std::make_shared<MipBlock>();
+        auto area = Rect{bx * MipBlockSize, by * MipBlockSize, MipBlockSize, MipBlockSize}
+            .intersected(Rect{0, 0, levels[k].width, levels[k].height});
+        uint32_t top[MipBlockSize * 2], bottom[MipBlockSize * 2], out[MipBlockSize];
+        // edges of odd sized levels repeat their last row and column
+        auto gather = [&](int row, uint32_t *to) {
+            int sy = row / MipBlockSize - by * 2, offset = (row % MipBlockSize) * MipBlockSize;
+            for (int i = 0; i < area.w * 2; i++) {
+                int col = std::min(area.x * 2 + i, srcWidth - 1);
+                int source = sy * 2 + col / MipBlockSize - bx * 2;
+                int at = offset + col % MipBlockSize;
+                to[i] = k ? blocks[source]->rgba[at]
+                          : tilePixels[source] ? toRgba(tilePixels[source][at]) : 0;
+            }
+        };
+        for (int row = 0; row < area.h; row++) {
+            int sourceRow = (area.y + row) * 2;
+            gather(sourceRow, top);
+            gather(std::min(sourceRow + 1, srcHeight - 1), bottom);
+            boxFilter(top, bottom, out, area.w);
+            for (int i = 0; i < area.w; i++) {
+                block->rgba[row * MipBlockSize + i] = out[i];
+                block->colors[row * MipBlockSize + i] = fromRgba(out[i]);
+            }
+        }
+        return block;
+    }
+
+    // Levels down to count, without any of their blocks yet
+    void addLevels(int count) const
+    {
+        while (int(levels.size()) < count) {
+            int w = ((levels.empty() ? width : levels.back().width) + 1) / 2;
+            int h = ((levels.empty() ? height : levels.back().height) + 1) / 2;
+            int blocksX = (w + MipBlockSize - 1) / MipBlockSize;
+            int blocksY = (h + MipBlockSize - 1) / MipBlockSize;
+            levels.push_back(MipLevel{w, h, blocksX, blocksY,
+                                      vector<MipBlockPtr>(size_t(blocksX) * blocksY)});
+        }
+    }
+
+    // Where the canvas is shown at the current zoom
+    Rect view() const
+    {
+        return Rect{x, y, ((width - 1) >> zoom) + 1, ((height - 1) >> zoom) + 1};
+    }
+
+    // Damages r and drops the blocks of every level that cover it
+    void changed(const Rect &r)
+    {
+        dirty.add(r);
+        for (size_t k = 0; k < levels.size(); k++) {
+            auto &level = levels[k];
+            auto area = shrink(r, int(k) + 1 + MipBlockShift);
+            for (int by = area.y; by < std::min(area.bottom(), level.blocksY); by++) {
+                for (int bx = area.x; bx < std::min(area.right(), level.blocksX); bx++) {
+                    level.blocks[size_t(by) * level.blocksX + bx] = nullptr;
+                }
+            }
+        }
+    }
+
+    Rect tileRect(size_t index) const
+    {
+        return Rect{int(index % tilesX) * TileSize, int(index / tilesX) * TileSize,
+                    TileSize, TileSize}.intersected(Rect{0, 0, width, height});
+    }
+
+    // The first write to a tile in an edit saves it, and a tile still shared
+    // with the history or the blank tile is copied before being written
+    Tile &writable(size_t index, Edit &changes)
+    {
+        auto &tile = tiles[index];
+        if (touched[index] != serial) {
+            touched[index] = serial;
+            changes.push_back(TileChange{index, tile});
+        }
+        if (tile.use_count() > 1) {
+            tile = std::make_shared<Tile>(load(tile));
+            remember(tile);
+        }
+        tile->used = frame;
+        tile->incompressible = false;
+        return load(tile);
+    }
+
+    // PackBits over colors: a control byte below 128 is followed by that many
+    // plus one literal colors, one from 128 up by a color repeated 3 times for
+    // 128, 4 times for 129 and so on
+    static void pack(const vector<Color> &pixels, vector<uint8_t> &out)
+    {
+        constexpr size_t MinRun = 3, MaxRun = 255 - 128 + MinRun, MaxLiterals = 128;
+        auto put = [&](Color c) {
+            out.push_back(uint16_t(c) & 0xff);
+            out.push_back(uint16_t(c) >> 8);
+        };
+        auto runAt = [&](size_t i) {
+            size_t run = 1;
+            while (i + run < pixels.size() and run < MaxRun and pixels[i + run] == pixels[i]) {
+                run++;
+            }
+            return run;
+        };
+        out.clear();
+        for (size_t i = 0; i < pixels.size();) {
+            if (auto run = runAt(i); run >= MinRun) {
+                out.push_back(128 + run - MinRun);
+                put(pixels[i]);
+                i += run;
+                continue;
+            }
+            size_t start = i;
+            while (i < pixels.size() and i - start < MaxLiterals and runAt(i) < MinRun) {
+                i++;
+            }
+            out.push_back(i - start - 1);
+            for (size_t j = start; j < i; j++) {
+                put(pixels[j]);
+            }
+        }
+    }
+
+    static Color packedColor(const uint8_t *p)
     {
-        for (auto &key : quitKeys) {
-            if (currEvent.key == key or currEvent.ch == key) {
-                running = false;
-            }
-        }
+        return Color{uint16_t(p[0] | p[1] << 8)};
     }
-    void processResize() {}
-    void processMouse() {}
-    unsigned getCurrentKey() const
+
+    static void unpack(const vector<uint8_t> &packed, Color *out)
     {
-        bool wrote = false;
-        if (currEvent.key != 0) {
-            log("key: ", currEvent.key);
-            wrote = true;
-        } if (currEvent.ch != 0) {
-            log(wrote ? " " : "", "ch: '", char(currEvent.ch), "'");
-            wrote = true;
-        } if (wrote) {
-            log(endl);
+        for (auto *p = packed.data(), *end = p + packed.size(); p < end;) {
+            unsigned control = *p++;
+            if (control >= 128) {
+                out = std::fill_n(out, control - 125, packedColor(p));
+                p += 2;
+            } else {
+                for (unsigned i = 0; i <= control; i++, p += 2) {
+                    *out++ = packedColor(p);
+                }
+            }
         }
-        return currEvent.key != 0 ? currEvent.key : currEvent.ch;
     }
 
-    void loop()
+    static bool packedContains(const vector<uint8_t> &packed, Color color)
     {
-        tb_clear();
-        screen->draw();
-        tb_present();
-        while (running) {
-            if (tb_peek_event(&currEvent, 1.0 / frameRate)) {
-                switch (currEvent.type) {
-                    case TB_EVENT_KEY:
-                        processKey();
-                    case TB_EVENT_RESIZE:
-                        processResize();
-                    case TB_EVENT_MOUSE:
-                        processMouse();
+        for (auto *p = packed.data(), *end = p + packed.size(); p < end;) {
+            unsigned control = *p++;
+            unsigned count = control >= 128 ? 1 : control + 1;
+            for (unsigned i = 0; i < count; i++, p += 2) {
+                if (packedColor(p) == color) {
+                    return true;
                 }
             }
-            screen->update();
-            tb_clear();
-            screen->draw();
-            tb_present();
         }
+        return false;
     }
 
-    void setScreen(uptr<Screen> screen)
+    // A tile's pixels for reading once, decoded into scratch if it's packed
+    static const Color *pixelsOf(const TilePtr &tile, vector<Color> &scratch)
     {
-        this->screen = move(screen);
-        this->screen->resize(getWidth(), getHeight());
+        if (not tile->pixels.empty()) {
+            return tile->pixels.data();
+        }
+        scratch.resize(TileSize * TileSize);
+        unpack(tile->packed, scratch.data());
+        return scratch.data();
     }
 
-    size_t getWidth() const noexcept
+    // A tile's pixels, unpacked first if it had gone cold
+    Tile &load(const TilePtr &tile) const
     {
-        return tb_width();
+        if (tile->pixels.empty()) {
+            tile->pixels.resize(TileSize * TileSize);
+            unpack(tile->packed, tile->pixels.data());
+            tile->packed = vector<uint8_t>{};
+            remember(tile);
+        }
+        return *tile;
     }
 
-    size_t getHeight() const noexcept
+    // Keeps track of unpacked tiles, which fills may do from several threads
+    void remember(const TilePtr &tile) const
     {
-        return tb_height();
+        std::lock_guard<std::mutex> lock{residentMutex};
+        resident.push_back(tile);
     }
 
-    void log() const {}
-    template <typename T, typename... Rest>
-    void log(T &&val, Rest &&...rest) const
+    // Packs the least recently used tiles until no more than the memory limit
+    // is unpacked, except for tiles drawn this frame and ones that don't pack,
+    // which both still count against it
+    void evict() const
     {
-        logStream << forward<T>(val);
-        log(forward<Rest>(rest)...);
+        if (resident.size() * TileBytes <= memoryLimit) {
+            return;
+        }
+        std::erase_if(resident, [](auto &tile) { return tile.expired(); });
+        auto allowed = memoryLimit / TileBytes;
+        if (resident.size() <= allowed) {
+            return;
+        }
+        vector<std::pair<uint32_t, size_t>> ages;
+        for (size_t i = 0; i < resident.size(); i++) {
+            auto tile = resident[i].lock();
+            if (tile->used != frame and not tile->incompressible) {
+                ages.emplace_back(frame - tile->used, i);
+            }
+        }
+        auto count = std::min(resident.size() - allowed, ages.size());
+        if (count < ages.size()) {
+            std::nth_element(ages.begin(), ages.begin() + count, ages.end(),
+                             std::greater<>{});
+        }
+        for (size_t i = 0; i < count; i++) {
+            auto &entry = resident[ages[i].second];
+            auto tile = entry.lock();
+            pack(tile->pixels, tile->packed);
+            if (tile->packed.size() < TileBytes) {
+                tile->pixels = vector<Color>{};
+                entry.reset();
+            } else {
+                tile->packed = vector<uint8_t>{};
+                tile->incompressible = true;
+            }
+        }
+        std::erase_if(resident, [](auto &tile) { return tile.expired(); });
     }
 
-    using Key = unsigned;
-    using Keys = vector<Key>;
-
-private:
-    uptr<Screen> screen;
-    int frameRate = 60;
-    tb_event currEvent;
-    Keys quitKeys = { 'q', TB_KEY_CTRL_C };
-    bool running = true;
-    mutable stringstream logStream;
-};
-
-uptr<Termbox> tb;
-
-/******************************************************************************/
-/* Circle                                                                      */
+    // Tests pixels for the fill's target color, without unpacking tiles that
+    // don't have it anywhere
+    bool isTarget(FillBand &band, int px, int py, Color target) const
+    {
+        auto &tile = tiles[(py / TileSize) * tilesX + px / TileSize];
+        if (tile->pixels.empty() and not mayHaveTarget(band, *tile, target)) {
+            return false;
+        }
+        return load(tile).pixels[(py % TileSize) * TileSize + px % TileSize] == target;
+    }
 
-class Circle : public IntEntity
-{
-public:
-    Circle(int x, int y, int radius, Color color)
-        : IntEntity{x, y}, radius{radius}, color{color} {}
+    static bool mayHaveTarget(FillBand &band, const Tile &tile, Color target)
+    {
+        auto [known, added] = band.packedHasTarget.try_emplace(&tile, false);
+        if (added) {
+            known->second = packedContains(tile.packed, target);
+        }
+        return known->second;
+    }
 
-    virtual void update() override {}
-    virtual void draw(Display &display) const override
+    void fillRow(int row, int from, int to, Color color, Edit &changes)
     {
-        for (int _x = -radius; _x <= radius; _x++) {
-            for (int _y = -radius; _y <= radius; _y++) {
-                if (_x * _x + _y * _y <= radius * radius) {
-                    display.putPoint(x - _x, y - _y, color);
-                }
+        int ty = row / TileSize, offset = (row % TileSize) * TileSize;
+        for (int tx = from / TileSize; tx <= to / TileSize; tx++) {
+            int x0 = std::max(from, tx * TileSize) - tx * TileSize;
+            int x1 = std::min(to, tx * TileSize + TileSize - 1) - tx * TileSize;
+            auto index = size_t(ty) * tilesX + tx;
+            auto *src = &load(tiles[index]).pixels[offset];
+            if (std::all_of(src + x0, src + x1 + 1, [&](Color c) { return c == color; })) {
+                continue;
             }
+            auto *dst = &writable(index, changes).pixels[offset];
+            std::fill(dst + x0, dst + x1 + 1, color);
         }
     }
-protected:
-    int radius;
-    Color color = Color::White;
-};
 
-class MyCircle : public Circle
-{
-public:
-    using Circle::Circle;
-    virtual void update() override
+    void swapTiles(Edit &edit)
     {
-        switch (tb->getCurrentKey()) {
-            case '+':
-                radius++;
-                break;
-            case '-':
-                radius--;
-                break;
-            case 'w':
-                y--;
-                break;
-            case 's':
-                y++;
-                break;
-            case 'd':
-                x++;
-                break;
-            case 'a':
-                x--;
-                break;
-            default:
-                break;
+        for (auto &change : edit) {
+            std::swap(tiles[change.index], change.tile);
+            changed(tileRect(change.index));
         }
     }
-};
 
+    // Scanline fill of the rows of one band: every seed is a range of a row
+    // where runs of the target color are looked for, each run found is filled
+    // whole and the rows above and below it are pushed as new seeds
+    void fillBand(FillBand &band, Color target, Color color, Edit &changes)
+    {
+        band.damage.resize((band.bottom - band.top + DamageRows - 1) / DamageRows);
+        auto &stack = band.seeds;
+        auto push = [&](int row, int x0, int x1) {
+            if (row < band.top) {
+                if (row >= 0) {
+                    band.up.push_back(Span{row, x0, x1});
+                }
+            } else if (row >= band.bottom) {
+                if (row < height) {
+                    band.down.push_back(Span{row, x0, x1});
+                }
+            } else {
+                stack.push_back(Span{row, x0, x1});
+            }
+        };
+        while (not stack.empty()) {
+            auto span = stack.back();
+            stack.pop_back();
+            for (int px = span.x0; px <= span.x1; px++) {
+                if (not isTarget(band, px, span.y, target)) {
+                    continue;
+                }
+                int from = px, to = px;
+                while (from > 0 and isTarget(band, from - 1, span.y, target)) {
+                    from--;
+                }
+                while (to + 1 < width and isTarget(band, to + 1, span.y, target)) {
+                    to++;
+                }
+                fillRow(span.y, from, to, color, changes);
+                auto &r = band.damage[(span.y - band.top) / DamageRows];
+                r = r.united(Rect{from, span.y, to - from + 1, 1});
+                push(span.y - 1, from, to);
+                push(span.y + 1, from, to);
+                px = to + 1;
+            }
+        }
+    }
+
+    int width, height;
+    int tilesX;
+    vector<TilePtr> tiles;
+    Damage dirty;
+
+    // built while drawing, as far down as has been zoomed out
+    int zoom = 0;
+    mutable vector<MipLevel> levels;
+    mutable vector<Color> decoded[4];
+    mutable Rect shown;
+
+    // unpacked tiles, whether on the canvas or in the history
+    size_t memoryLimit = 64 << 20;
+    mutable vector<std::weak_ptr<Tile>> resident;
+    mutable std::mutex residentMutex;
+    mutable uint32_t frame = 0;
+
+    Edit current;
+    vector<Edit> undoStack, redoStack;
+    vector<uint32_t> touched;   // serial of the edit that last saved each tile
+    uint32_t serial = 1;
+
+    int brushRadius = 1;
+    Color brushColor = Color::White;
+    bool stroking = false;
+    bool filling = false;
+    int lastX = 0, lastY = 0;
+};
 /******************************************************************************/
 /* Tests                                                                      */
 
@@ -610,22 +6885,476 @@ void test_divSOG(Screen &screen)
     screen.addEntity(make_unique<Point>(24, col++, white / .5));
 }
 
+void test_ParticleSystem(Screen &screen)
+{
+    screen.addEntity(make_unique<ParticleSystem>(80, 10, 1000000));
+}
+
+void test_Collisions(Screen &screen)
+{
+    // about one circle per 100 pixels, only the top-left corner is visible
+    constexpr int count = 100000;
+    Rect world{0, 0, 1000, count / 1000 * 10};
+    std::minstd_rand rng;
+    for (int i = 0; i < count; i++) {
+        int dx = rng() % 2 ? 1 : -1, dy = rng() % 2 ? 1 : -1;
+        screen.addEntity(make_unique<BouncingCircle>(
+                    rng() % world.w, rng() % world.h, 1, dx, dy, world));
+    }
+}
+
+void test_LifeGrid(Screen &screen)
+{
+    std::minstd_rand rng;
+    auto life = make_unique<LifeGrid>(0, 0, tb->getWidth(), tb->getHeight() * 2);
+    life->randomize(rng);
+    screen.addEntity(move(life));
+}
+
+void test_Fractal(Screen &screen)
+{
+    screen.addEntity(make_unique<Fractal>(0, 0, tb->getWidth(), tb->getHeight() * 2));
+}
+
+void test_MeshRenderer(Screen &screen)
+{
+    // $MESH may point to an OBJ file, otherwise a 100k triangle torus is used
+    Mesh mesh = Mesh::torus(1.0f, 0.4f, 250, 200);
+    if (auto path = getenv("MESH")) {
+        string error;
+        if (not Mesh::loadObj(path, mesh, error)) {
+            tb->log(error, endl);
+            return;
+        }
+    }
+    screen.addEntity(make_unique<MeshRenderer>(
+                0, 0, tb->getWidth(), tb->getHeight() * 2, move(mesh)));
+}
+
+void test_Raycaster(Screen &screen)
+{
+    vector<string> map = {
+        "################",
+        "#      #       #",
+        "#  1   #   22  #",
+        "#      #       #",
+        "#  #####   #   #",
+        "#          #   #",
+        "#   33     #   #",
+        "#          #   #",
+        "######  ####   #",
+        "#              #",
+        "#    1    2    #",
+        "################",
+    };
+    screen.addEntity(make_unique<Raycaster>(
+                0, 0, tb->getWidth(), tb->getHeight() * 2, move(map)));
+}
+
+void test_TileMap(Screen &screen)
+{
+    constexpr int size = 10000;
+    auto map = make_unique<TileMap>(0, 0, tb->getWidth(), tb->getHeight() * 2,
+                                    size, size);
+    auto solid = [](Color a, Color b) {
+        vector<Color> p;
+        for (int i = 0; i < TileMap::TileSize * TileMap::TileSize; i++) {
+            p.push_back((i / TileMap::TileSize + i) % 5 ? a : b);
+        }
+        return p;
+    };
+    auto water = map->addTile(solid(Color{0, 64, 192}, Color{64, 128, 255}));
+    auto grass = map->addTile(solid(Color{0, 160, 0}, Color{64, 192, 0}));
+    auto sand = map->addTile(solid(Color{192, 192, 64}, Color{255, 255, 128}));
+
+    // mostly uniform chunks, with a detailed shore every few chunks
+    constexpr int chunks = (size + TileMap::ChunkTiles - 1) / TileMap::ChunkTiles;
+    std::minstd_rand rng;
+    for (int cy = 0; cy < chunks; cy++) {
+        for (int cx = 0; cx < chunks; cx++) {
+            map->fillChunk(cx, cy, (cx / 4 + cy / 4) % 2 ? grass : water);
+        }
+    }
+    for (int ty = 0; ty < 256; ty++) {
+        for (int tx = 0; tx < 256; tx++) {
+            if (rng() % 4 == 0) {
+                map->setTile(tx, ty, sand);
+            }
+        }
+    }
+    screen.addEntity(move(map));
+}
+
+void test_Sprite(Screen &screen)
+{
+    std::map<char, Color> palette = {
+        { '#', Color{255, 255, 0} }, { 'o', Color{0, 0, 0} }, { '-', Color{255, 0, 0} },
+    };
+    auto sheet = std::make_shared<SpriteSheet>();
+    sheet->frameTime = std::chrono::milliseconds{150};
+    sheet->frames.push_back(Bitmap::fromText({
+        "  #####  ",
+        " ####### ",
+        "###o##o##",
+        "#########",
+        "##-----##",
+        " ##---## ",
+        "  #####  ",
+    }, palette));
+    sheet->frames.push_back(Bitmap::fromText({
+        "  #####  ",
+        " ####### ",
+        "###o##o##",
+        "#########",
+        "#########",
+        " ##---## ",
+        "  #####  ",
+    }, palette));
+
+    // one sheet, many sprites
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    for (int y = 0; y + 8 < height; y += 10) {
+        for (int x = 0; x + 9 < width; x += 12) {
+            screen.addEntity(make_unique<Sprite>(x, y, sheet));
+        }
+    }
+}
+
+class Orbit : public SceneNode
+{
+public:
+    Orbit(int cx, int cy, int radius, double phase)
+        : SceneNode{cx, cy, nullptr, true}, cx{cx}, cy{cy}, radius{radius},
+          phase{phase} {}
+
+    void update() override
+    {
+        phase += 0.05;
+        moveTo(cx + int(radius * std::cos(phase)), cy + int(radius * std::sin(phase)));
+        SceneNode::update();
+    }
+
+private:
+    int cx, cy, radius;
+    double phase;
+};
+
+void test_SceneNode(Screen &screen)
+{
+    // four groups of 250 circles, each group moves as a whole
+    auto root = make_unique<SceneNode>();
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    for (int g = 0; g < 4; g++) {
+        auto group = make_unique<Orbit>(width / 2, height / 2, height / 3, g * M_PI / 2);
+        for (int i = 0; i < 250; i++) {
+            int angle = i * 360 / 250;
+            int r = 4 + i % 4 * 2;
+            group->addContent(make_unique<Circle>(int(r * std::cos(angle * M_PI / 180)),
+                                           int(r * std::sin(angle * M_PI / 180)),
+                                           1, Color::makeSOG(8 + g * 4)));
+        }
+        root->add(move(group));
+    }
+    screen.addEntity(move(root));
+}
+
+void test_Animator(Screen &screen)
+{
+    auto &animator = screen.getAnimator();
+    int width = tb->getWidth();
+    for (int e = 0; e < int(Easing::Count); e++) {
+        auto circle = make_unique<Circle>(4, 8 + e * 10, 3, Color::makeSOG(23));
+        float right = width - 5;
+        animator.animate(*circle, Property::X, {
+            { 0, 4 }, { 2, right, Easing(e) }, { 4, 4, Easing(e) },
+        }, true);
+        animator.animate(*circle, Property::Radius, {
+            { 0, 2 }, { 0.5, 4, Easing::QuadOut }, { 1, 2, Easing::QuadIn },
+        }, true);
+        animator.animate(*circle, Property::Gray, {
+            { 0, 23 }, { 1.5, 6 }, { 3, 23 },
+        }, true);
+        screen.addEntity(move(circle));
+    }
+    // a one-shot tween that drops out after a second
+    auto point = make_unique<Point>(0, 2, Color::White);
+    animator.tween(*point, Property::X, 0, width - 1, 1.0, Easing::CubicInOut);
+    screen.addEntity(move(point));
+}
+
+class Blinker : public Circle
+{
+public:
+    using Circle::Circle;
+
+    // only its behaviors change it
+    bool wantsUpdate() const override
+    {
+        return false;
+    }
+
+    Behavior blink(std::chrono::milliseconds period)
+    {
+        auto on = color;
+        for (;;) {
+            color = color == on ? Color::makeSOG(4) : on;
+            co_await sleep(period);
+        }
+    }
+
+    // moves with wasd, one key press at a time
+    Behavior steer()
+    {
+        for (;;) {
+            switch (co_await key()) {
+                case 'w': y -= 2; break;
+                case 's': y += 2; break;
+                case 'a': x -= 2; break;
+                case 'd': x += 2; break;
+                default: break;
+            }
+        }
+    }
+};
+
+void test_Behaviors(Screen &screen)
+{
+    // a thousand blinkers which only run when their period is up
+    std::minstd_rand rng;
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    for (int i = 0; i < 1000; i++) {
+        auto blinker = make_unique<Blinker>(rng() % width, rng() % height, 0,
+                                            Color::makeSOG(23));
+        screen.getBehaviors().start(blinker->blink(200ms + rng() % 1800 * 1ms));
+        screen.addEntity(move(blinker));
+    }
+    auto player = make_unique<Blinker>(width / 2, height / 2, 2, Color{255, 0, 0});
+    screen.getBehaviors().start(player->steer());
+    screen.addEntity(move(player));
+}
+
+void test_Timers(Screen &screen)
+{
+    // widgets on their own schedules, between expirations the loop sleeps
+    std::minstd_rand rng;
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    for (int i = 0; i < 5000; i++) {
+        auto point = make_unique<Point>(rng() % width, rng() % height,
+                                        Color::makeSOG(23));
+        auto *color = point->getProperty(Property::Gray).color;
+        auto period = std::chrono::seconds(1 + rng() % 60);
+        screen.getTimers().schedule(period, [color] {
+            *color = *color == Color::makeSOG(23) ? Color::makeSOG(8)
+                                                  : Color::makeSOG(23);
+        }, period);
+        screen.addEntity(move(point));
+    }
+}
+
+void test_FrameBudget(Screen &screen)
+{
+    // more work than fits in a frame: each entity is degraded all the way
+    // before the next one, so the torus at the back goes flat and is then
+    // deferred, then the game of life, and the torus in front comes last
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    std::minstd_rand rng;
+    auto life = make_unique<LifeGrid>(0, 0, width, height);
+    life->randomize(rng);
+    auto back = make_unique<MeshRenderer>(0, 0, width / 2, height,
+                                          Mesh::torus(1.0f, 0.3f, 300, 200));
+    auto front = make_unique<MeshRenderer>(width / 2, 0, width - width / 2, height,
+                                           Mesh::torus(1.0f, 0.4f, 250, 200));
+    screen.getBudget().add(*back, 0);
+    screen.getBudget().add(*life, 1);
+    screen.getBudget().add(*front, 2);
+    screen.addEntity(move(life));
+    screen.addEntity(move(back));
+    screen.addEntity(move(front));
+}
+
+Behavior toggleAntialiasing(vector<SmoothCircle *> circles)
+{
+    bool on = true;
+    for (;;) {
+        co_await key('a');
+        on = not on;
+        for (auto *c : circles) {
+            c->setAntialiased(on);
+        }
+    }
+}
+
+void test_Subpixel(Screen &screen)
+{
+    // rows of circles drifting at a fraction of a pixel per frame, 'a' toggles
+    // antialiasing
+    int width = tb->getWidth(), height = tb->getHeight() * 2;
+    Rect world{0, 0, width, height};
+    vector<SmoothCircle *> circles;
+    for (int i = 0; i < 8; i++) {
+        auto speed = Fixed::fromRaw(8 + 16 * i);    // 1/32 up to ~1/2 pixel
+        auto circle = make_unique<SmoothCircle>(
+                Fixed(8), Fixed(6 + i * (height - 12) / 8), Fixed(3.5f),
+                Color::makeSOG(23), speed, speed / 4, world);
+        circles.push_back(circle.get());
+        screen.getBudget().add(*circle, i);
+        screen.addEntity(move(circle));
+    }
+    // a still circle next to a blinker: with the drifting circles, the damage
+    // bounds span the still one without clearing it, its edges must not change
+    auto still = make_unique<SmoothCircle>(Fixed(width - 12), Fixed(6), Fixed(4.5f),
+                                           Color::makeSOG(23));
+    circles.push_back(still.get());
+    screen.addEntity(move(still));
+    auto blinker = make_unique<Blinker>(width - 4, 6, 1, Color{255, 0, 0});
+    screen.getBehaviors().start(blinker->blink(100ms));
+    screen.addEntity(move(blinker));
+    screen.getBehaviors().start(toggleAntialiasing(circles));
+}
+
+void test_SceneFile(Screen &screen)
+{
+    // $SCENE points to a binary scene, see "convert"
+    auto path = getenv("SCENE");
+    if (not path) {
+        tb->log("set $SCENE to a scene file", endl);
+        return;
+    }
+    string error;
+    auto start = std::chrono::steady_clock::now();
+    auto scene = MappedScene::load(path, error);
+    if (not scene) {
+        tb->log(error, endl);
+        return;
+    }
+    tb->log("loaded ", scene->entities(), " entities in ",
+            std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start).count(), "ms", endl);
+    // picks up rewrites, e.g. from convert, without waking the loop otherwise
+    if (not scene->watch(error)) {
+        tb->log(error, endl);
+    }
+    screen.getTimers().schedule(100ms, [scene = scene.get()] {
+        string error;
+        if (not scene->reloadIfChanged(error) and not error.empty()) {
+            tb->log(error, endl);
+        }
+    }, 100ms);
+    screen.addEntity(move(scene));
+}
+
+Behavior cycleBrushColor(Canvas &canvas)
+{
+    const Color colors[] = { Color::White, Color::Red, Color::Green, Color::Yellow,
+                             Color::Blue, Color::Magenta, Color::Cyan };
+    for (size_t i = 1;; i++) {
+        co_await key('c');
+        canvas.setBrush(canvas.getBrushRadius(), colors[i % std::size(colors)]);
+    }
+}
+
+// Runs action every time k is pressed
+Behavior onKey(unsigned k, std::function<void()> action)
+{
+    for (;;) {
+        co_await key(k);
+        action();
+    }
+}
+
+void test_Paint(Screen &screen)
+{
+    // left button paints, right erases, middle fills, the wheel sizes the
+    // brush, 'c' cycles its color, 'u'/'r' undo and redo, '-'/'+' zoom and the
+    // arrows scroll. $CANVAS_SCALE makes the canvas that many screens wide and
+    // high, $CANVAS_MEMORY caps its unpacked tiles in MiB.
+    auto scaleVar = getenv("CANVAS_SCALE");
+    int scale = scaleVar ? std::max(1, std::atoi(scaleVar)) : 1;
+    auto canvas = make_unique<Canvas>(0, 0, tb->getWidth() * scale,
+                                      tb->getHeight() * 2 * scale);
+    auto *c = canvas.get();
+    canvas->setBrush(2, Color::White);
+    screen.getBehaviors().start(cycleBrushColor(*canvas));
+    screen.getBehaviors().start(onKey('u', [c] { c->undo(); }));
+    screen.getBehaviors().start(onKey('r', [c] { c->redo(); }));
+    screen.getBehaviors().start(onKey('-', [c] { c->setZoom(c->getZoom() + 1); }));
+    screen.getBehaviors().start(onKey('+', [c] { c->setZoom(c->getZoom() - 1); }));
+    screen.getBehaviors().start(onKey(TB_KEY_ARROW_LEFT, [c] { c->scroll(-16, 0); }));
+    screen.getBehaviors().start(onKey(TB_KEY_ARROW_RIGHT, [c] { c->scroll(16, 0); }));
+    screen.getBehaviors().start(onKey(TB_KEY_ARROW_UP, [c] { c->scroll(0, -16); }));
+    screen.getBehaviors().start(onKey(TB_KEY_ARROW_DOWN, [c] { c->scroll(0, 16); }));
+    if (auto limit = getenv("CANVAS_MEMORY")) {
+        canvas->setMemoryLimit(size_t(std::atoi(limit)) << 20);
+    }
+    screen.addEntity(move(canvas));
+}
+
+/******************************************************************************/
+/* Scenes                                                                     */
+
+using Scene = void (*)(Screen &);
+
+void scene_default(Screen &screen)
+{
+    test_MyCircle(screen);
+    test_colorConsts(screen);
+    test_makeSOG(screen);
+    test_addSOG(screen);
+    test_mulSOG(screen);
+    test_divSOG(screen);
+}
+
+const std::map<string, Scene> Scenes = {
+    { "default",    scene_default },
+    { "particles",  test_ParticleSystem },
+    { "collisions", test_Collisions },
+    { "life",       test_LifeGrid },
+    { "fractal",    test_Fractal },
+    { "mesh",       test_MeshRenderer },
+    { "raycaster",  test_Raycaster },
+    { "tilemap",    test_TileMap },
+    { "sprites",    test_Sprite },
+    { "scenegraph", test_SceneNode },
+    { "tweens",     test_Animator },
+    { "behaviors",  test_Behaviors },
+    { "timers",     test_Timers },
+    { "budget",     test_FrameBudget },
+    { "subpixel",   test_Subpixel },
+    { "scenefile",  test_SceneFile },
+    { "paint",      test_Paint },
+};
+
 /******************************************************************************/
 /* Main                                                                       */
 
 int main(int argc, char *argv[])
 {
+    if (argc > 1 and string{argv[1]} == "convert") {
+        if (argc != 4) {
+            cerr << "usage: " << argv[0] << " convert SCENE.txt SCENE.bin" << endl;
+            return -1;
+        }
+        std::ifstream in{argv[2]};
+        string error;
+        if (not in or not MappedScene::convert(in, argv[3], error)) {
+            cerr << (in ? error : concat(argv[2], ": ", strerror(errno))) << endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    auto scene = Scenes.find(argc > 1 ? argv[1] : "default");
+    if (scene == Scenes.end()) {
+        cerr << "unknown scene '" << argv[1] << "'" << endl;
+        return -1;
+    }
+
     tb = make_unique<Termbox>();
     if (not tb->init()) {
         return -1;
     }
     auto screen = make_unique<Screen>(make_unique<PixelDisplay>());
-    test_MyCircle(*screen);
-    test_colorConsts(*screen);
-    test_makeSOG(*screen);
-    test_addSOG(*screen);
-    test_mulSOG(*screen);
-    test_divSOG(*screen);
+    scene->second(*screen);
 
     tb->setScreen(move(screen));
     tb->loop();